@@ -4,6 +4,7 @@
 // ----------------------------------------------------------
 
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <getopt.h>
 #include <stdlib.h>
@@ -12,7 +13,16 @@
 #include <string.h>
 #include <strings.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <math.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
 
 
 
@@ -59,6 +69,28 @@ typedef struct DataChunk
 } DataChunk;
 
 
+// Aligned writer of wave output (--direct), header and audio share one buffer
+typedef struct DirectWriter
+{
+    int fd;                 // File descriptor of output
+    int direct;             // 1 if opened with O_DIRECT, 0 after falling back
+    BYTE *buffer;           // DIRECT_BUFFER bytes, aligned to DIRECT_ALIGN
+    long fill;              // Bytes in buffer
+    long offset;            // File offset of buffer, multiple of DIRECT_ALIGN
+    int error;              // errno of first failed write, 0 if none
+} DirectWriter;
+
+
+// Features of a track for similarity ordering
+typedef struct Features
+{
+    float level;            // RMS level of part in dBFS
+    float tempo;            // Tempo estimate in BPM, 0 if unknown
+    float centroid;         // Spectral centroid in Hz
+    int key;                // Key estimate: 0-11 major, 12-23 minor (C = 0), -1 if unknown
+} Features;
+
+
 // Store audio tracks in a linked list, like a playlist
 typedef struct Track
 {
@@ -68,6 +100,19 @@ typedef struct Track
     char *name;             // File name
     char *path;             // Full path incl. file name
     FILE *audiofile;        // Pointer to file for read and copy
+    long dataOffset;        // Byte offset of audio data within file
+    long markerIn;          // Sample position of in-marker within track
+    float loudness;         // Integrated loudness in LUFS (normalization)
+    float gain;             // Linear gain applied on output (normalization)
+    float *onsets;          // Onset envelopes of head and tail (beat alignment)
+    struct Features features; // Similarity features (-o similar)
+    long shift;             // Samples in-marker was moved by beat alignment
+    int changed;            // Probed since last render, analysis pending (watch mode)
+    struct FlacStream *flac;// FLAC decoder, NULL for wave files
+    struct FlacEncoder *encoder; // FLAC encoder of output, NULL for wave output
+    struct Preview *preview;     // Preview reader of track or preview output, NULL for full render
+    struct DirectWriter *direct; // Aligned O_DIRECT writer of output, NULL for stdio
+    struct Stretch *stretch;     // Tempo-matched crossfade into next track, NULL for plain crossfade
     struct Track *prev;     // Pointer to previous track
     struct Track *next;     // Pointer to next track
     struct RiffChunk riff;  // RIFF Chunk, file info
@@ -77,20 +122,232 @@ typedef struct Track
 Track;
 
 
+// FLAC seek point: first sample of a frame and its byte offset from the first frame
+typedef struct SeekPoint
+{
+    uint64_t sample;        // First sample in target frame
+    uint64_t offset;        // Byte offset of target frame from first frame
+} SeekPoint;
+
+
+// FLAC frame header, the part needed to decode and seek
+typedef struct FrameHeader
+{
+    long firstSample;       // Number of first sample in frame
+    long blockSize;         // Samples per channel in frame
+    int channelMode;        // 0-7: independent channels, 8: left/side, 9: side/right, 10: mid/side
+    int length;             // Byte length of header incl. CRC-8
+} FrameHeader;
+
+
+// FLAC decoder state of a track, decodes one frame (block) at a time
+typedef struct FlacStream
+{
+    int fd;                 // File descriptor, read with pread
+    int channels;           // Channels from STREAMINFO
+    long firstFrame;        // Byte offset of first frame (end of metadata)
+    long fileSize;          // Byte size of file
+    long seekTable;         // Byte offset of SEEKTABLE, 0 if there is none
+    long seekCount;         // Number of seek points
+    SeekPoint *points;      // Seek points, read on first seek
+    long minBlock;          // Minimum block size from STREAMINFO
+    long maxBlock;          // Maximum block size from STREAMINFO
+    long totalSamples;      // Samples per channel from STREAMINFO
+    long target;            // Pending seek to sample, -1 if none
+    long blockStart;        // First sample of decoded block
+    long blockFrames;       // Samples per channel in decoded block
+    long blockPos;          // Read position within decoded block
+    long lostUntil;         // First sample after frames lost to corruption, read as silence up to there
+    int16_t *block;         // Decoded block, interleaved
+    int32_t *work;          // Decoded subframes, maxBlock per channel
+    long offset;            // Byte offset of buffer within file
+    int length;             // Valid bytes in buffer
+    int pos;                // Read position within buffer
+    uint64_t bitCache;      // Bits taken from buffer, not yet consumed
+    int bitCount;           // Number of bits in bitCache
+    BYTE buffer[65536];     // Read buffer
+} FlacStream;
+
+
+// Bytes of an encoded FLAC frame, written bit by bit
+typedef struct BitWriter
+{
+    BYTE *bytes;            // Encoded bytes
+    long length;            // Number of complete bytes
+    uint64_t cache;         // Bits not yet complete to a byte
+    int count;              // Number of bits in cache
+} BitWriter;
+
+
+// Blocks of PCM encoded together by the worker threads
+typedef struct EncodeBatch
+{
+    int16_t *pcm;           // Interleaved PCM, blockSize frames per block
+    long frames[64];        // Frames per block (last block may be short)
+    BitWriter out[64];      // Encoded frame per block
+    long count;             // Blocks in batch
+    long firstFrame;        // Frame number of first block
+    long next;              // Next block to be picked up by a worker
+    long done;              // Blocks encoded
+} EncodeBatch;
+
+
+// FLAC encoder of output: fixed block size, blocks encoded in parallel, written in order
+typedef struct FlacEncoder
+{
+    FILE *file;             // Output file
+    long blockSize;         // Samples per channel per block
+    int channels;           // Number of channels
+    long rate;              // Sample rate
+    long totalSamples;      // Samples per channel in whole stream
+    long samples;           // Samples per channel written so far
+    long bytes;             // Bytes of frames written so far
+    long minFrame;          // Smallest frame in bytes
+    long maxFrame;          // Largest frame in bytes
+    long seekSpacing;       // Samples between seek points
+    long seekCount;         // Number of seek points
+    SeekPoint *points;      // Seek points, written on finish
+    long *pointFrames;      // Samples in frame of seek point
+    EncodeBatch batch[2];   // Batch being filled, batch being encoded
+    int filling;            // Index of batch being filled
+    EncodeBatch *active;    // Batch handed to workers, NULL if none
+    int quit;               // Workers end when set
+    int error;              // Set if a block could not be encoded (out of memory)
+    long workers;           // Number of worker threads
+    pthread_t *threads;     // Worker threads
+    pthread_mutex_t lock;   // Guards active, quit, error and batch counters
+    pthread_cond_t work;    // Signals workers: new batch or quit
+    pthread_cond_t finished;// Signals main thread: batch done
+} FlacEncoder;
+
+
+// Preview: tracks are read as mono and decimated by a windowed sinc low pass, rendering runs at the
+// preview rate. Output only holds the filter and writes 8 or 16 bit
+typedef struct Preview
+{
+    int factor;             // Decimation factor
+    int taps;               // Filter length: 12 * factor + 1
+    float *coefs;           // Low pass filter coefficients, owned by output
+    long phase;             // Source sample of preview sample 0, relative to in-marker
+    long at;                // Source sample the file pointer is at, -1 if unknown
+    float *mono;            // Mono source samples under the filter for the block
+    int16_t *block;         // Preview samples from first on
+    long first;             // Preview sample of block[0]
+    long count;             // Preview samples in block
+} Preview;
+
+
+// Tempo-matched crossfade of a track into the next one (--match-tempo), rendered ahead of output
+typedef struct Stretch
+{
+    float ratio;            // Tempo change over the crossfade: next tempo / tempo, octave folded
+    long tailStart;         // Start of crossfade in track, samples after in-marker
+    long consumed;          // Samples of next track played during the crossfade
+    long length;            // Frames per channel in tail and head
+    long pre;               // Frames in tail and head before the crossfade starts
+    float *tail;            // Audio of track around crossfade, planar, freed when rendered
+    float *head;            // Audio of next track around crossfade, planar, freed when rendered
+    int16_t *frames;        // Rendered crossfade: samplesFade - 1 interleaved frames
+} Stretch;
+
+
 // Prototypes
 void printWelcome();
 void printHelp();
 void printTracks(Track *playlist);
 void numberTracks(Track *playlist);
+Track *insertTrack(Track *playlist, Track *new);
+Track *removeTrack(Track *playlist, Track *delete);
+int probeTrack(Track *play, Track *output, float iflag, float dflag, float xflag);
 void deleteTrack(Track *track);
+void processTracks(Track *playlist, void (*task)(Track *track), int changedOnly);
+void measureLoudness(Track *track);
+void findMarker(Track *track);
+void onsetEnvelope(Track *track, long start, long count, float *envelope);
+void measureOnsets(Track *track);
+float *makeTwiddles(long size);
+void fft(float *re, float *im, long size, float *twiddles);
+void alignBeats(Track *playlist);
+void measureFeatures(Track *track);
+void measureTempo(Track *track);
+float trackDistance(Track *a, Track *b);
+Track *orderTracks(Track *playlist);
+void matchTempos(Track *playlist);
+void readEdges(Track *track);
+void readPlanar(Track *track, long start, long count, float *planar);
+void stretchCrossfade(Track *track);
+int stretchSource(float *source, long length, long pre, int channels, float ratio, float scale, float *window, long size,
+                  float *out, long count);
+float similarity(float *a, float *b, long n);
+void freeStretch(Track *track);
+void renderMedley(Track *playlist, Track *output, Track *first, char *cflag);
+long trackOffset(Track *track);
+void renderFrame(Track *copy, long i, int16_t *transfer_main);
+void seekTrack(Track *track);
+uint64_t hashBytes(uint64_t hash, void *data, size_t size);
+uint64_t segmentKey(Track *track, Track *fade, long from, long to);
+int copyCached(char *path, Track *output, long bytes, int blockAlign);
+int16_t clip16(double sample);
+int checkFormat(Track *play, Track *output);
+int checkData(Track *play, Track *output, float iflag, float dflag, float xflag);
+void seekSample(Track *track, long sample);
+long readFrames(Track *track, int16_t *buffer, long frames);
+uint64_t readBigEndian(BYTE *bytes, int n);
+int readStreamInfo(Track *track);
+void freeFlac(FlacStream *flac);
+void flacReposition(FlacStream *flac, long offset);
+int flacByte(FlacStream *flac);
+uint32_t readBits(FlacStream *flac, int n);
+int32_t readSigned(FlacStream *flac, int n);
+uint32_t readUnary(FlacStream *flac);
+int parseFrameHeader(FlacStream *flac, BYTE *bytes, int length, FrameHeader *header);
+int decodeResidual(FlacStream *flac, int32_t *out, long blockSize, int order);
+int decodeSubframe(FlacStream *flac, int32_t *out, long blockSize, int bps);
+int decodeFrame(FlacStream *flac);
+int nextBlock(FlacStream *flac);
+int nextFrameHeader(FlacStream *flac, long from, long to, long *at, FrameHeader *header);
+void flacSeek(FlacStream *flac, long target);
+void writeFrames(Track *output, int16_t *frames, long count);
+void emitFrames(Track *output, void *data, long count);
+int startPreview(Track *playlist, Track *output, int factor, int bits);
+void readPart(Track *track, int16_t *frame);
+void fillPreview(Track *track);
+void readMono(Track *track, long start, long count, float *mono);
+void previewFrames(Track *output, int16_t *frames, long count);
+void finishPreview(Track *output);
+void freePreview(Track *track);
+int startDirect(Track *output);
+int flushDirect(DirectWriter *writer, long bytes);
+void writeBytes(Track *output, void *data, long bytes);
+int finishDirect(Track *output);
+uint64_t trackKey(Track *track);
+int waitChanges(int notify, char ***names);
+int startEncoder(Track *output);
+int finishEncoder(Track *output);
+void freeEncoder(FlacEncoder *encoder);
+void putBits(BitWriter *writer, uint32_t value, int n);
+void putSigned(BitWriter *writer, int32_t value, int n);
+BYTE crc8(BYTE *bytes, long length);
+void makeCrc16Table();
+WORD crc16(BYTE *bytes, long length);
+long riceBits(int32_t *residual, long blockSize, int order, int *partitionOrder, int *params);
+void putResidual(BitWriter *writer, int32_t *residual, long blockSize, int order, int partitionOrder, int *params);
+void encodeSubframe(BitWriter *writer, int32_t *x, long n, int bps, int32_t *residual);
+void encodeBlock(EncodeBatch *batch, long b, FlacEncoder *encoder);
+void *encodeWorker(void *arg);
+void submitBatch(FlacEncoder *encoder);
 
 
 // Global variables
 long samplesIn;             // sample position of in mark
 long samplesPart;           // sample length of each track slice
 long samplesFade;           // sample length of crossfade
+long samplesShift = 0;      // max shift of in-marker for beat alignment
 int fileCount = 0;          // audio files found in directory
 int trackCount = 0;         // count of valid tracks added to playlist
+int wholeTrack = 0;         // measure loudness of whole track instead of slice
+int autoIn = 0;             // pick in-marker per track by analysis (-i auto)
+int formatFixed = 0;        // output is written, new tracks must match its format (watch mode)
 
 
 // Big endian encoded 4 character identifiers to check against
@@ -99,6 +356,20 @@ const DWORD WAVE = 0x45564157;
 const DWORD FMT  = 0x20746d66;
 const DWORD DATA = 0x61746164;
 const DWORD DS64 = 0x34367364;
+const DWORD FLAC = 0x43614c66;
+
+
+// Direct output: block alignment (covers 512 byte and 4K sectors) and buffer size
+#define DIRECT_ALIGN 4096
+#define DIRECT_BUFFER (4 << 20)
+
+
+// Preview: samples computed per block of a track
+#define PREVIEW_BLOCK 1024
+
+
+// Bump when rendering changes, invalidates all cached segments
+const long CACHE_VERSION = 1;
 
 
 
@@ -123,15 +394,41 @@ int main(int argc, char **argv)
 
     // Define allowed command line flags and default values
     int flag;
-    char *flags = "hr:w:i:d:x:";
+    char *flags = "hr:w:i:d:x:n:c:o:";
     char *rflag = "audio/";     // (r)ead source directory
     char *wflag = "medley.wav"; // (w)rite to output file
     float  iflag = 1;           // (i)n-marker in seconds
     float  dflag = 2;           // (d)uration of track in seconds
     float  xflag = 0.5;         // (x)fade trackDuration in seconds
+    float  nflag = 0;           // (n)ormalize to target loudness in LUFS
+    int normalize = 0;          // loudness normalization enabled by -n
+    char *cflag = NULL;         // (c)ache directory for rendered segments
+    float  bflag = 0;           // (b)eat alignment: max shift of next track in ms, 0 for off
+    int similar = 0;            // (o)rder playlist by similarity instead of name
+    int direct = 0;             // write wave output with O_DIRECT
+    int watch = 0;              // keep watching source directory, update output on changes
+    int matchTempo = 0;         // ramp tempos of both tracks toward each other in crossfades
+    int previewKhz = 0;         // preview sample rate in kHz (11 or 22), 0 for full render
+    int previewBits = 16;       // preview bit depth (8 or 16)
+
+    // Long options, mostly for flags without a short form
+    struct option longFlags[] =
+    {
+        {"normalize",   required_argument, NULL, 'n'},
+        {"whole-track", no_argument,       NULL, 'W'},
+        {"cache",       required_argument, NULL, 'c'},
+        {"preview",     optional_argument, NULL, 'P'},
+        {"8bit",        no_argument,       NULL, '8'},
+        {"beat-align",  optional_argument, NULL, 'B'},
+        {"order",       required_argument, NULL, 'o'},
+        {"direct",      no_argument,       NULL, 'D'},
+        {"watch",       no_argument,       NULL, 'I'},
+        {"match-tempo", no_argument,       NULL, 'M'},
+        {NULL, 0, NULL, 0}
+    };
 
     // Get and check user provided flags
-    while ((flag = getopt(argc, argv, flags)) != -1)
+    while ((flag = getopt_long(argc, argv, flags, longFlags, NULL)) != -1)
     {
         switch (flag)
         {
@@ -153,6 +450,12 @@ int main(int argc, char **argv)
                 break;
 
             case 'i':
+                if (!strcasecmp(optarg, "auto"))
+                {
+                    autoIn = 1;
+                    iflag = 0;
+                    break;
+                }
                 iflag = atof(optarg);
                 if (iflag < 0)
                 {
@@ -179,6 +482,75 @@ int main(int argc, char **argv)
                 }
                 break;
 
+            case 'n':
+                nflag = atof(optarg);
+                normalize = 1;
+                if (nflag >= 0 || nflag < -70)
+                {
+                    printf("\033[0;31m[ERROR]\033[0m Check your target loudness: -n (LUFS between -70 and 0)\n\nTo see the help page type ./medley -h\n\n");
+                    return 1;
+                }
+                break;
+
+            case 'W':
+                wholeTrack = 1;
+                break;
+
+            case 'c':
+                cflag = optarg;
+                if (mkdir(cflag, 0777) != 0 && errno != EEXIST)
+                {
+                    printf("\033[0;31m[ERROR]\033[0m Couldn't create cache directory: -c %s\n\nTo see the help page type ./medley -h\n\n", cflag);
+                    return 5;
+                }
+                break;
+
+            case 'P':
+                previewKhz = optarg ? atoi(optarg) : 11;
+                if (previewKhz != 11 && previewKhz != 22)
+                {
+                    printf("\033[0;31m[ERROR]\033[0m Check your preview rate: --preview=11 or --preview=22 (kHz)\n\nTo see the help page type ./medley -h\n\n");
+                    return 1;
+                }
+                break;
+
+            case '8':
+                previewBits = 8;
+                break;
+
+            case 'B':
+                bflag = optarg ? atof(optarg) : 250;
+                if (bflag <= 0 || bflag > 2000)
+                {
+                    printf("\033[0;31m[ERROR]\033[0m Check your beat alignment: --beat-align=MS (max shift between 1 and 2000 ms)\n\nTo see the help page type ./medley -h\n\n");
+                    return 1;
+                }
+                break;
+
+            case 'o':
+                if (!strcasecmp(optarg, "similar"))
+                {
+                    similar = 1;
+                }
+                else if (strcasecmp(optarg, "name"))
+                {
+                    printf("\033[0;31m[ERROR]\033[0m Check your order: -o name or -o similar\n\nTo see the help page type ./medley -h\n\n");
+                    return 1;
+                }
+                break;
+
+            case 'D':
+                direct = 1;
+                break;
+
+            case 'I':
+                watch = 1;
+                break;
+
+            case 'M':
+                matchTempo = 1;
+                break;
+
             case '?':
                 printf("\033[0;31m[ERROR]\033[0m Wrong command line arguments found\n\nTo see the help page type ./medley -h\n\n");
                 return 1;
@@ -197,6 +569,50 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    // Check preview options: 8 bit only for wave previews
+    char *wext = strrchr(wflag, '.');
+    int flacOut = wext != NULL && !strcasecmp(wext, ".flac");
+    if (previewBits == 8 && (!previewKhz || flacOut))
+    {
+        printf("\033[0;31m[ERROR]\033[0m --8bit only applies to wave previews: --preview\n\nTo see the help page type ./medley -h\n\n");
+        return 1;
+    }
+
+    // Check direct output: FLAC metadata is rewritten at the end, only for wave
+    if (direct && flacOut)
+    {
+        printf("\033[0;31m[ERROR]\033[0m --direct only applies to wave output: -w name.wav\n\nTo see the help page type ./medley -h\n\n");
+        return 1;
+    }
+
+    // Check watch mode: output is updated in place, only for full wave output
+    if (watch && (flacOut || previewKhz || direct))
+    {
+        printf("\033[0;31m[ERROR]\033[0m --watch only applies to wave output without --preview and --direct\n\nTo see the help page type ./medley -h\n\n");
+        return 1;
+    }
+
+    // Check beat alignment: needs a crossfade to align
+    if (bflag > 0 && xflag == 0)
+    {
+        printf("\033[0;31m[ERROR]\033[0m --beat-align needs a crossfade: -x (length in seconds)\n\nTo see the help page type ./medley -h\n\n");
+        return 1;
+    }
+
+    // Check tempo matching: needs a crossfade to stretch
+    if (matchTempo && xflag == 0)
+    {
+        printf("\033[0;31m[ERROR]\033[0m --match-tempo needs a crossfade: -x (length in seconds)\n\nTo see the help page type ./medley -h\n\n");
+        return 1;
+    }
+
+    // Check loudness measurement range
+    if (wholeTrack && !normalize)
+    {
+        printf("\033[0;31m[ERROR]\033[0m --whole-track only applies to loudness normalization: -n (LUFS)\n\nTo see the help page type ./medley -h\n\n");
+        return 1;
+    }
+
 
 
 // ----------------------------------------------------------
@@ -241,9 +657,9 @@ int main(int argc, char **argv)
     // Read dir entry and move to next
     while ((direntry = readdir(dir)))
     {
-        // Check for correct file extension: .wav, .wave, .bfw
+        // Check for correct file extension: .wav, .wave, .bfw, .flac
         char *ext = strrchr(direntry->d_name, '.');
-        if (ext && (!strcasecmp(ext, ".wav") || !strcasecmp(ext, ".wave") || !strcasecmp(ext, ".bwf")))
+        if (ext && (!strcasecmp(ext, ".wav") || !strcasecmp(ext, ".wave") || !strcasecmp(ext, ".bwf") || !strcasecmp(ext, ".flac")))
         {
             // Add track to playlist
             fileCount++;
@@ -259,7 +675,6 @@ int main(int argc, char **argv)
             }
 
             // Fill Track structure with data
-            new->name = direntry->d_name;
             new->prev = NULL;
             new->next = NULL;
 
@@ -277,6 +692,9 @@ int main(int argc, char **argv)
             new->path = strcat(new->path, direntry->d_name);
             new->path = strcat(new->path, "\0");
 
+            // Name points into path, direntry is reused by readdir
+            new->name = new->path + strlen(rflag);
+
 
 
 // ----------------------------------------------------------
@@ -285,48 +703,8 @@ int main(int argc, char **argv)
 // ----------------------------------------------------------
 
 
-            // Adjust next and prev pointer
-            if (fileCount == 1)
-            {
-                // If this is the first file, set playlist (head of list) to point to it, no next
-                playlist = new;
-            }
-            else
-            {
-                // Search pointer travels thru playlist
-                Track *search = playlist;
-                while (search != NULL)
-                {
-                    // Sort case-insensitive by name
-                    if (strcasecmp(new->name, search->name) < 0)
-                    {
-                        // Put new before search
-                        if (search->prev != NULL)
-                        {
-                            search->prev->next = new;
-                            new->prev = search->prev;
-                            search->prev = new;
-                            new->next = search;
-                        }
-                        // Put new to head of playlist
-                        else
-                        {
-                            playlist->prev = new;
-                            new->next = playlist;
-                            playlist = new;
-                        }
-                        break;
-                    }
-                    // Put new to end of playlist
-                    if (search->next == NULL)
-                    {
-                        search->next = new;
-                        new->prev = search;
-                        break;
-                    }
-                    search = search->next;
-                }
-            }
+            // Put new track in place, playlist may be empty
+            playlist = insertTrack(playlist, new);
         }
     }
 
@@ -349,200 +727,8 @@ int main(int argc, char **argv)
 
     while (play != NULL)
     {
-        // Open file for reading
-        play->audiofile = fopen(play->path, "r");
-
-        // Helper loop for error handling (break on skipFlag)
-        do
-        {
-            // STATUS PRINT: ID and name
-            printf("No %i - %s ", play->trackNumber, play->name);
-
-            // Handle file write access error
-            if (play->audiofile == NULL)
-            {
-                printf("\033[0;31m[ERROR]\033[0m Could not open file at %s\n", play->path);
-                skipFlag = 1;
-                break;
-            }
-
-            // Handle RIFF header
-            fread(&play->riff, sizeof(RiffChunk), 1, play->audiofile);
-            if (play->riff.ckID != RIFF)
-            {
-                printf("\033[0;33m[SKIPPED]\033[0m Only RIFF Files are supported\n");
-                skipFlag = 1;
-                break;
-            }
-
-            // Handle WAVE header
-            if (play->riff.riffType != WAVE)
-            {
-                printf("\033[0;33m[SKIPPED]\033[0m Only PCM Files are supported\n");
-                skipFlag = 1;
-                break;
-            }
-
-
-
-// ----------------------------------------------------------
-// R E A D I N G   C H U N K S
-// Read chunks (ckID, chSize) till fmt & data chunk is found
-// Ignore and skip all other chunks, e.g. BEXT chunk (BWF)
-// ----------------------------------------------------------
-
-
-            do
-            {
-                // Handle padding, skip NUL character(s)
-                char check_padding;
-                fread(&check_padding, sizeof(char), 1, play->audiofile);
-                if (check_padding == 0) // Probe for NUL
-                {
-                    continue;
-                }
-                else    // Rewind last fread and continue if not NUL
-                {
-                    fseek(play->audiofile, -sizeof(char), SEEK_CUR);
-                }
-
-                // Check for chunkID
-                DWORD check_Id;
-                fread(&check_Id, sizeof(DWORD), 1, play->audiofile);
-
-                // Check for chunkSize
-                DWORD ckSize;
-                fread(&ckSize, sizeof(DWORD), 1, play->audiofile);
-
-// ----------------------------------------------------------
-// F O R M A T   C H U N K
-// ----------------------------------------------------------
-
-                if (check_Id == FMT)
-                {
-                    fseek(play->audiofile, -sizeof(DWORD) * 2, SEEK_CUR);
-                    fread(&play->fmt, sizeof(FmtChunk), 1, play->audiofile);
-
-                    // Only allow 16 bit files -> sample allways holds int16_t
-                    // 8 Bit: require unsigned integer uint8_t
-                    // 24 bit: require non-primitive datatype int24_t
-                    // 32 bit: require floating point arithmethic
-                    if (play->fmt.wBitsPerSample != 16)
-                    {
-                        printf("\033[0;33m[SKIPPED]\033[0m Only 16 bit files are supported, %i bit are not\n", play->fmt.wBitsPerSample);
-                        skipFlag = 1;
-                        break;
-                    }
-
-                    // Reject surround wave files
-                    if (play->fmt.nChannels > 2)
-                    {
-                        printf("\033[0;33m[SKIPPED]\033[0m Multichannel files are not supported\n");
-                        skipFlag = 1;
-                        break;
-                    }
-
-                    // Set fmt data to master if this is the first track
-                    if (trackCount == 0)
-                    {
-                        output->fmt = play->fmt;
-                    }
-                    // Validate all other tracks against the master and reject if format does not match
-                    else
-                    {
-                        if (output->fmt.nChannels != play->fmt.nChannels)
-                        {
-                            printf("\033[0;33m[SKIPPED]\033[0m Channel count (%hu Ch) does not match first track (%hu Ch)\n", play->fmt.nChannels,
-                                   output->fmt.nChannels);
-                            skipFlag = 1;
-                            break;
-                        }
-                        else if (output->fmt.nSamplesPerSec != play->fmt.nSamplesPerSec)
-                        {
-                            printf("\033[0;33m[SKIPPED]\033[0m Samplerate (%u Hz) does not match first track (%u Hz)\n", play->fmt.nSamplesPerSec,
-                                   output->fmt.nSamplesPerSec);
-                            skipFlag = 1;
-                            break;
-                        }
-                        else if (output->fmt.wBitsPerSample != play->fmt.wBitsPerSample)
-                        {
-                            printf("\033[0;33m[SKIPPED]\033[0m Bit depth (%hu bit) does not match first track (%hu bit)\n", play->fmt.wBitsPerSample,
-                                   output->fmt.wBitsPerSample);
-                            skipFlag = 1;
-                            break;
-                        }
-                    }
-
-                    // Move *audiofile to end of fmt chunk (skipping padding bytes if there are any)
-                    fseek(play->audiofile, -sizeof(FmtChunk) + 2 * sizeof(DWORD) + play->fmt.ckSize, SEEK_CUR);
-
-                    // Continue to search for data chunk
-                    continue;
-                }
-
-// ----------------------------------------------------------
-// D A T A   C H U N K
-// ----------------------------------------------------------
-
-                if (check_Id == DATA)
-                {
-                    play->data.ckID = check_Id;
-                    play->data.ckSize = ckSize;
-
-                    // Calculate trackDuration in seconds
-                    play->trackDuration = (float) play->data.ckSize * 8 / (play->fmt.nChannels * play->fmt.nSamplesPerSec * play->fmt.wBitsPerSample);
-
-                    // Check for in-mark within track duration
-                    if (iflag > play->trackDuration)
-                    {
-                        printf("\033[0;31m[ERROR]\033[0m In-marker (%.2f) outside of track (%.2f)\n", iflag, play->trackDuration);
-                        // printf("\033[0;31m[ERROR]\033[0m In-marker %s\n", play->path);
-                        skipFlag = 1;
-                        break;
-                    }
-
-                    // Calculate globals as first valid track is found (i.e. valid fmt chunk and valid data chunk)
-                    if (trackCount == 0)
-                    {
-                        samplesIn = iflag * output->fmt.nSamplesPerSec;
-                        samplesPart = dflag * output->fmt.nSamplesPerSec;
-                        samplesFade = xflag * output->fmt.nSamplesPerSec;
-                    }
-
-                    // FF pointer to in marker
-                    fseek(play->audiofile, samplesIn * output->fmt.nChannels * output->fmt.wBitsPerSample / 8, SEEK_CUR);
-
-                    // Valid track, no skipFlag
-                    break;
-                }
-
-                // Reject RF64 BWF (encountered ds64 chunk)
-                if (check_Id == DS64)
-                {
-                    printf("\033[0;33m[SKIPPED]\033[0m RF64 BWF is not supported\n");
-                    skipFlag = 1;
-                    break;
-                }
-
-                // Check for reaching End Of File
-                if (feof(play->audiofile))
-                {
-                    printf("\033[0;33m[SKIPPED]\033[0m No audio data found, file corruption\n");
-                    skipFlag = 1;
-                    break;
-                }
-
-                // Skip all other chunks
-                fseek(play->audiofile, ckSize, SEEK_CUR);
-
-            }
-            while (skipFlag == 0);
-
-            // Break helper loop when track is valid
-            break;
-
-        }
-        while (1);
+        // Open file, read and check its chunks (or FLAC STREAMINFO)
+        skipFlag = probeTrack(play, output, iflag, dflag, xflag);
 
 
 
@@ -560,44 +746,18 @@ int main(int argc, char **argv)
 
             Track *delete = play;
 
-            // Remove if only one track in list
-            if (play->next == NULL && play->prev == NULL)
-            {
-                playlist = NULL;
-            }
-
-            // Remove from head of list (no previous)
-            else if (play->prev == NULL)
-            {
-                playlist = play->next;
-                playlist->prev = NULL;
-            }
-            // Remove from end of list (no next)
-            else if (play->next == NULL)
-            {
-                play->prev->next = NULL;
-            }
-            // Remove from middle of list
-            else
-            {
-                play->next->prev = play->prev;
-                play->prev->next = play->next;
-            }
-
-            // Close audiofile
-            fclose(delete->audiofile);
-
             // Move play pointer to next track (on invalid track found)
             play = play->next;
 
-            // Free memory
-            free(delete->path);
-            free(delete);
+            // Unlink, close and free invalid track
+            playlist = removeTrack(playlist, delete);
         }
         else
         {
             // VALID TRACK, keep in playlist
             play->sampleCount = 0;
+            play->gain = 1;
+            play->changed = 1;
             trackCount++;
 
 
@@ -628,183 +788,531 @@ int main(int argc, char **argv)
 
 
 // ----------------------------------------------------------
-// O U T P U T
-// Reading of playlist is done, start writing to output file
+// A U T O   I N - M A R K E R
+// Find the most energetic part of every track in parallel
+// and move its in-marker there
 // ----------------------------------------------------------
 
-    printf("\n\nCreating medley from %i audio files:\n",  trackCount);
-    printf("\n0%%                  50%%                100%%");
-    printf("\n┣━━━━━━━━━━━━━━━━━━━━┻━━━━━━━━━━━━━━━━━━━━┫");
-    printf("\n ");
 
-    // Data chunk: Set Id
-    output->data.ckID = DATA;
+    if (autoIn)
+    {
+        printf("\n\nSearching the most energetic %.2f seconds of each track:\n\n", dflag);
 
-    // Data chunk: Calculate raw audio size -> samples out = n * length - (n - 1) * fade
-    output->data.ckSize = ((trackCount * samplesPart) - (trackCount - 1) * samplesFade) * output->fmt.nBlockAlign;
+        processTracks(playlist, findMarker, 0);
 
-    // RIFF chunk: Copy from Playlist
-    output->riff = playlist->riff;
+        Track *marker = playlist;
+        while (marker != NULL)
+        {
+            printf("No %i - %s \033[0;32m(in-marker at %.2f seconds)\033[0m\n", marker->trackNumber, marker->name,
+                   (float) marker->markerIn / output->fmt.nSamplesPerSec);
+            marker = marker->next;
+        }
+    }
 
-    // Format chunk: Set size to 16 Bytes (standard wave header)
-    output->fmt.ckSize = 16;
 
-    // RIFF chunk: Calculate filesize -> 36 + output->data.ckSize;
-    output->riff.ckSize = sizeof(WAVE) + sizeof(RIFF) + 4 + output->fmt.ckSize + sizeof(DATA) + 4 + output->data.ckSize;
 
-    // Set name (optional)
-    output->name = wflag;
+// ----------------------------------------------------------
+// S I M I L A R I T Y   O R D E R
+// Analyze every track in parallel (level, tempo, brightness,
+// key) and order playlist for smooth transitions
+// ----------------------------------------------------------
 
-    // Set trackDuration
-    output->trackDuration = (float) output->data.ckSize * 8 / (output->fmt.nChannels * output->fmt.nSamplesPerSec *
-                            output->fmt.wBitsPerSample);
 
-    // Open Output file for writing
-    output->audiofile = fopen(output->name, "w");
-    if (output->audiofile == NULL)
+    if (similar && playlist != NULL)
     {
-        printf("\033[0;31m[ERROR]\033[0m Could not write to file: %s\n\n", wflag);
-        deleteTrack(playlist);
-        free(output);
-        closedir(dir);
-        return 5;
-    }
+        printf("\n\nOrdering %i tracks by similarity:\n\n", trackCount);
 
-    // Write RIFF chunk
-    fwrite(&output->riff, sizeof(RiffChunk), 1, output->audiofile);
+        processTracks(playlist, measureFeatures, 0);
 
-    // Write format chunk
-    fwrite(&output->fmt, sizeof(FmtChunk), 1, output->audiofile);
+        Track *ordered = orderTracks(playlist);
+        if (ordered == NULL)
+        {
+            printf("\033[0;31m[ERROR]\033[0m Couldn't allocate memory for ordering playlist.\n\nAbort! Let Martin know about this...\n\n");
+            deleteTrack(playlist);
+            free(output);
+            return 2;
+        }
+        playlist = ordered;
+        numberTracks(playlist);
 
-    // Write data chunk header
-    fwrite(&output->data, sizeof(DataChunk), 1, output->audiofile);
+        char *keys[] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+        Track *feature = playlist;
+        while (feature != NULL)
+        {
+            printf("No %i - %s \033[0;32m(%.0f BPM, %s%s, %.0f Hz, %.1f dB)\033[0m\n", feature->trackNumber, feature->name,
+                   feature->features.tempo, feature->features.key >= 0 ? keys[feature->features.key % 12] : "?",
+                   feature->features.key >= 12 ? "m" : "", feature->features.centroid, feature->features.level);
+            feature = feature->next;
+        }
+    }
 
-    // Transfer one frame (bit depth * channel) from audiofile -> writefile
-    int16_t transfer_main[output->fmt.nChannels];
-    int16_t transfer_fade[output->fmt.nChannels];
 
-    // Read raw audio from playlist
-    Track *copy = playlist;
 
-    // Total samples and count of medley for process bar
-    long total = output->data.ckSize / output->fmt.nBlockAlign;
-    long total_count = 0;
-    int total_division = 40;
-    int total_process = 0;
+// ----------------------------------------------------------
+// B E A T   A L I G N M E N T
+// Shift in-marker of every next track within a small window
+// so that onsets (beats) match in the crossfade
+// ----------------------------------------------------------
 
-    // Loop thru playlist and copy audio data to output
-    while (copy != NULL)
+
+    if (bflag > 0 && playlist != NULL)
     {
+        printf("\n\nAligning beats in crossfades, up to %.0f ms:\n\n", bflag);
 
-        for (long i = 0; i < samplesPart; i++)
-        {
-            // Skip fade in on all but first track
-            if (copy->trackNumber > 1 && i == 0)
-            {
-                i += samplesFade;
+        samplesShift = bflag / 1000 * output->fmt.nSamplesPerSec;
+        processTracks(playlist, measureOnsets, 0);
+        alignBeats(playlist);
+    }
+
+
+
+// ----------------------------------------------------------
+// L O U D N E S S   N O R M A L I Z A T I O N
+// Measure integrated loudness (EBU R128) of every track in
+// parallel and derive a gain, applied while writing output
+// ----------------------------------------------------------
+
+
+    if (normalize)
+    {
+        printf("\n\nMeasuring loudness of %s, target %.1f LUFS:\n\n", wholeTrack ? "whole tracks" : "track slices", nflag);
+
+        processTracks(playlist, measureLoudness, 0);
+
+        Track *measure = playlist;
+        while (measure != NULL)
+        {
+            // Silent tracks never pass the gate, leave them untouched
+            if (isfinite(measure->loudness))
+            {
+                measure->gain = powf(10, (nflag - measure->loudness) / 20);
+                printf("No %i - %s \033[0;32m(%.1f LUFS, %+.1f dB)\033[0m\n", measure->trackNumber, measure->name, measure->loudness,
+                       nflag - measure->loudness);
             }
-            // FADE IN
-            if (i < samplesFade)
+            else
             {
-                fread(&transfer_main, output->fmt.wBitsPerSample / 8, output->fmt.nChannels, copy->audiofile);
+                printf("No %i - %s \033[0;33m(silent, no gain)\033[0m\n", measure->trackNumber, measure->name);
+            }
+            measure = measure->next;
+        }
+    }
 
-                for (int j = 0; j < output->fmt.nChannels; j++)
-                {
-                    // Linear Fade In
-                    // transfer_main[j] = transfer_main[j] * (float)i / samplesFade;
 
-                    // Squareroot Fade In
-                    transfer_main[j] = transfer_main[j] * sqrt((float)i / samplesFade);
-                }
 
-                // DEBUG
-                // printf("\n[%li] %li / %li : %i @ %li IN ", total_count, i, samplesPart, copy->trackNumber, copy->sampleCount);
-            }
-            else if (i > samplesPart - samplesFade)
+// ----------------------------------------------------------
+// T E M P O   M A T C H I N G
+// Stretch both tracks of every crossfade so their tempos
+// ramp toward each other, transitions render in parallel
+// ----------------------------------------------------------
+
+
+    if (matchTempo && playlist != NULL)
+    {
+        printf("\n\nMatching tempos in crossfades:\n\n");
+
+        // Tempo is known already when ordered by similarity
+        if (!similar)
+        {
+            processTracks(playlist, measureTempo, 0);
+        }
+        matchTempos(playlist);
+    }
+
+
+
+// ----------------------------------------------------------
+// O U T P U T
+// Reading of playlist is done, start writing to output file
+// ----------------------------------------------------------
+
+    // Data chunk: Set Id
+    output->data.ckID = DATA;
+
+    // Data chunk: Calculate raw audio size -> samples out = n * length - (n - 1) * fade
+    output->data.ckSize = ((trackCount * samplesPart) - (trackCount - 1) * samplesFade) * output->fmt.nBlockAlign;
+
+    // Preview: same layout at the preview rate, mono and maybe 8 bit
+    // Input rate is divided by the nearest integer, e.g. 48 kHz by 4 to 12 kHz for --preview
+    int factor = 1;
+    DWORD rate = output->fmt.nSamplesPerSec;
+    if (previewKhz)
+    {
+        factor = lround((float) output->fmt.nSamplesPerSec / (previewKhz * 1000));
+        factor = factor > 1 ? factor : 1;
+        if (startPreview(playlist, output, factor, previewBits) != 0)
+        {
+            printf("\033[0;31m[ERROR]\033[0m Couldn't allocate memory for preview.\n\nAbort! Let Martin know about this...\n\n");
+            deleteTrack(playlist);
+            free(output);
+            return 2;
+        }
+        printf("\n\nCreating preview of medley from %i audio files (mono, %i Hz = %i Hz / %i):\n", trackCount,
+               output->fmt.nSamplesPerSec, rate, factor);
+    }
+    else
+    {
+        printf("\n\nCreating medley from %i audio files:\n", trackCount);
+    }
+    printf("\n0%%                  50%%                100%%");
+    printf("\n┣━━━━━━━━━━━━━━━━━━━━┻━━━━━━━━━━━━━━━━━━━━┫");
+    printf("\n ");
+
+    // RIFF chunk: Set Ids (first track may be FLAC)
+    output->riff.ckID = RIFF;
+    output->riff.riffType = WAVE;
+
+    // Format chunk: Set size to 16 Bytes (standard wave header)
+    output->fmt.ckSize = 16;
+
+    // RIFF chunk: Calculate filesize -> 36 + output->data.ckSize (+ pad byte for odd 8 bit data)
+    output->riff.ckSize = sizeof(WAVE) + sizeof(RIFF) + 4 + output->fmt.ckSize + sizeof(DATA) + 4 + output->data.ckSize + output->data.ckSize % 2;
+
+    // Set name (optional)
+    output->name = wflag;
+
+    // Set trackDuration
+    output->trackDuration = (float) output->data.ckSize * 8 / (output->fmt.nChannels * output->fmt.nSamplesPerSec *
+                            output->fmt.wBitsPerSample);
+
+    // Open Output file for writing, aligned O_DIRECT writer or stdio
+    int opened = 0;
+    if (direct)
+    {
+        opened = startDirect(output);
+        if (opened == 2)
+        {
+            printf("\033[0;31m[ERROR]\033[0m Couldn't allocate memory for direct output.\n\nAbort! Let Martin know about this...\n\n");
+            deleteTrack(playlist);
+            free(output);
+            return 2;
+        }
+    }
+    else
+    {
+        output->audiofile = fopen(output->name, "w");
+        opened = output->audiofile == NULL ? 5 : 0;
+    }
+    if (opened != 0)
+    {
+        printf("\033[0;31m[ERROR]\033[0m Could not write to file: %s\n\n", wflag);
+        deleteTrack(playlist);
+        free(output);
+        closedir(dir);
+        return 5;
+    }
+
+    // Wave size is known: reserve it in one piece against fragmentation (file size grows as written)
+    // Failing is harmless (e.g. no fallocate on this filesystem), space is then taken as written
+    if (!flacOut)
+    {
+        fallocate(output->direct != NULL ? output->direct->fd : fileno(output->audiofile), FALLOC_FL_KEEP_SIZE, 0,
+                  output->riff.ckSize + 8);
+    }
+
+    // FLAC output: metadata now, frames encoded in parallel while writing
+    if (flacOut)
+    {
+        if (startEncoder(output) != 0)
+        {
+            printf("\033[0;31m[ERROR]\033[0m Couldn't allocate memory for FLAC encoder.\n\nAbort! Let Martin know about this...\n\n");
+            fclose(output->audiofile);
+            deleteTrack(playlist);
+            free(output);
+            return 2;
+        }
+    }
+    else
+    {
+        // Write RIFF chunk
+        writeBytes(output, &output->riff, sizeof(RiffChunk));
+
+        // Write format chunk
+        writeBytes(output, &output->fmt, sizeof(FmtChunk));
+
+        // Write data chunk header
+        writeBytes(output, &output->data, sizeof(DataChunk));
+    }
+
+    // Render all tracks into output
+    renderMedley(playlist, output, playlist, cflag);
+
+    // Preview: pad odd 8 bit data
+    if (output->preview != NULL)
+    {
+        finishPreview(output);
+    }
+
+    // Encode and write remaining blocks, complete FLAC metadata
+    if (output->encoder != NULL && finishEncoder(output) != 0)
+    {
+        printf("\n\n\033[0;31m[ERROR]\033[0m Couldn't allocate memory for FLAC encoder.\n\nAbort! Let Martin know about this...\n\n");
+        fclose(output->audiofile);
+        deleteTrack(playlist);
+        free(output);
+        return 2;
+    }
+
+    // Direct output: write what is left, a failed write would leave holes in the file
+    if (output->direct != NULL)
+    {
+        int error = finishDirect(output);
+        if (error != 0)
+        {
+            printf("\n\n\033[0;31m[ERROR]\033[0m Could not write to file: %s (%s)\n\n", wflag, strerror(error));
+            deleteTrack(playlist);
+            free(output);
+            return 5;
+        }
+    }
+
+    printf("\n\nEnjoy your %.0f second \033[0;31mm\033[0;32me\033[0;34md\033[0;36ml\033[0;35me\033[0;33my\033[0m: ./%s\n\n",
+           output->trackDuration, wflag);
+
+
+
+// ----------------------------------------------------------
+// W A T C H   M O D E
+// Keep playlist in memory, probe changed files again and
+// render output again from the first changed part on
+// ----------------------------------------------------------
+
+
+    // Exit code, watch mode may end on an error
+    int status = 0;
+
+    if (watch)
+    {
+        // Output is complete while waiting, its format stays for all tracks probed from now on
+        fflush(output->audiofile);
+        formatFixed = 1;
+
+        int notify = inotify_init();
+        if (notify < 0 || inotify_add_watch(notify, rflag, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0)
+        {
+            printf("\033[0;31m[ERROR]\033[0m Couldn't watch the directory: %s\n\nTo see the help page type ./medley -h\n\n", rflag);
+            fclose(output->audiofile);
+            free(output);
+            deleteTrack(playlist);
+            return 3;
+        }
+
+        // Keys of the rendered parts, position by position
+        int renderedCount = trackCount;
+        uint64_t *rendered = malloc(trackCount * sizeof(uint64_t));
+        int position = 0;
+        for (Track *part = playlist; part != NULL && rendered != NULL; part = part->next)
+        {
+            rendered[position++] = trackKey(part);
+            part->changed = 0;
+        }
+        if (rendered == NULL)
+        {
+            printf("\033[0;31m[ERROR]\033[0m Couldn't allocate memory for watching.\n\nAbort! Let Martin know about this...\n\n");
+            status = 2;
+        }
+
+        while (rendered != NULL)
+        {
+            printf("Watching %s for changes (Ctrl+C to stop)\n\n", rflag);
+
+            char **names = NULL;
+            int nameCount = waitChanges(notify, &names);
+
+            // Probe changed files again: drop the old track, add the file again if it (still) exists
+            for (int n = 0; n < nameCount; n++)
             {
-                // CROSSFADE
-                if (copy->next != NULL)
+                char *ext = strrchr(names[n], '.');
+                char path[strlen(rflag) + strlen(names[n]) + 1];
+                sprintf(path, "%s%s", rflag, names[n]);
+                if (!ext || (strcasecmp(ext, ".wav") && strcasecmp(ext, ".wave") && strcasecmp(ext, ".bwf") && strcasecmp(ext, ".flac"))
+                    || !strcmp(path, wflag))
                 {
-                    fread(&transfer_main, output->fmt.wBitsPerSample / 8, output->fmt.nChannels, copy->audiofile);
-                    fread(&transfer_fade, output->fmt.wBitsPerSample / 8, output->fmt.nChannels, copy->next->audiofile);
+                    continue;
+                }
 
-                    for (int j = 0; j < output->fmt.nChannels; j++)
+                for (Track *old = playlist; old != NULL; old = old->next)
+                {
+                    if (!strcmp(old->name, names[n]))
                     {
-                        // Linear cross fade
-                        // transfer_main[j] = transfer_main[j] * (1 - (float)(i - samplesPart + samplesFade) / samplesFade);
-                        // transfer_fade[j] = transfer_fade[j] * (float)(i - samplesPart + samplesFade) / samplesFade;
-
-                        // Squareroot fade out
-                        transfer_main[j] = transfer_main[j] * sqrt(1 - (float)(i - samplesPart + samplesFade) / samplesFade);
-                        transfer_fade[j] = transfer_fade[j] * sqrt((float)(i - samplesPart + samplesFade) / samplesFade);
-
-                        // Summing
-                        transfer_main[j] = transfer_main[j] + transfer_fade[j];
+                        playlist = removeTrack(playlist, old);
+                        trackCount--;
+                        break;
                     }
+                }
 
-                    // DEBUG
-                    // printf("\n[%li] %li / %li : %i @ %li XX %i @ %li", total_count, i, samplesPart, copy->trackNumber, copy->sampleCount, copy->next->trackNumber, copy->next->sampleCount);
+                if (access(path, R_OK) != 0)
+                {
+                    printf("%s \033[0;33m(removed)\033[0m\n", names[n]);
+                    continue;
+                }
 
-                    // Forward X-fade file
-                    copy->next->sampleCount++;
+                Track *new = calloc(sizeof(Track), 1);
+                if (new == NULL || (new->path = strdup(path)) == NULL)
+                {
+                    printf("\033[0;31m[ERROR]\033[0m Couldn't allocate memory for %s\nAbort! Let Martin know this\n\n", names[n]);
+                    free(new);
+                    status = 2;
+                    break;
                 }
-                // FADE OUT
-                else
+                new->name = new->path + strlen(rflag);
+                playlist = insertTrack(playlist, new);
+                numberTracks(playlist);
+
+                if (probeTrack(new, output, iflag, dflag, xflag))
                 {
-                    fread(&transfer_main, output->fmt.wBitsPerSample / 8, output->fmt.nChannels, copy->audiofile);
+                    playlist = removeTrack(playlist, new);
+                    continue;
+                }
+                new->gain = 1;
+                new->changed = 1;
+                trackCount++;
+                printf("\033[0;32m(%hu Ch, %u Hz, %hu bit, %.2f seconds)\033[0m\n", new->fmt.nChannels, new->fmt.nSamplesPerSec,
+                       new->fmt.wBitsPerSample, new->trackDuration);
+            }
+            for (int n = 0; n < nameCount; n++)
+            {
+                free(names[n]);
+            }
+            free(names);
+            numberTracks(playlist);
 
-                    for (int j = 0; j < output->fmt.nChannels; j++)
-                    {
-                        // Linear fade out
-                        // transfer_main[j] = transfer_main[j] * (1 - (float)(i - samplesPart + samplesFade) / samplesFade);
+            // Out of memory: close everything as on a normal exit
+            if (status != 0)
+            {
+                break;
+            }
 
-                        // Squareroot fade out
-                        transfer_main[j] = transfer_main[j] * sqrt(1 - (float)(i - samplesPart + samplesFade) / samplesFade);
-                    }
+            if (playlist == NULL)
+            {
+                printf("\033[0;33m[SKIPPED]\033[0m No audio files left in %s, output not updated\n\n", rflag);
+                continue;
+            }
 
-                    // DEBUG
-                    // printf("\n[%li of %li] %li / %li : %i @ %li OUT", total_count, total, i, samplesPart, copy->trackNumber, copy->sampleCount);
+            // Analysis as in first run: per track only for changed tracks,
+            // beat alignment depends on the track before and runs on all tracks
+            if (autoIn)
+            {
+                processTracks(playlist, findMarker, 1);
+            }
+            if (similar)
+            {
+                processTracks(playlist, measureFeatures, 1);
+                Track *ordered = orderTracks(playlist);
+                if (ordered != NULL)
+                {
+                    playlist = ordered;
+                    numberTracks(playlist);
                 }
             }
-            // SOLO TRACK
-            else
+            if (bflag > 0)
             {
-                fread(&transfer_main, output->fmt.wBitsPerSample / 8, output->fmt.nChannels, copy->audiofile);
-
-                // DEBUG
-                // printf("\n[%li] %li / %li : %i @ %li --", total_count, i, samplesPart, copy->trackNumber, copy->sampleCount);
+                for (Track *part = playlist; part != NULL; part = part->next)
+                {
+                    part->markerIn -= part->shift;
+                    part->shift = 0;
+                }
+                processTracks(playlist, measureOnsets, 0);
+                alignBeats(playlist);
+            }
+            if (normalize)
+            {
+                processTracks(playlist, measureLoudness, bflag == 0);
+                for (Track *part = playlist; part != NULL; part = part->next)
+                {
+                    part->gain = isfinite(part->loudness) ? powf(10, (nflag - part->loudness) / 20) : 1;
+                }
+            }
+            if (matchTempo)
+            {
+                if (!similar)
+                {
+                    processTracks(playlist, measureTempo, 1);
+                }
+                matchTempos(playlist);
             }
 
-            fwrite(&transfer_main, output->fmt.wBitsPerSample / 8, output->fmt.nChannels, output->audiofile);
+            // First position whose part differs from the rendered output
+            Track *start = playlist;
+            position = 0;
+            while (start != NULL && position < renderedCount && trackKey(start) == rendered[position])
+            {
+                start = start->next;
+                position++;
+            }
+            if (start == NULL && position == renderedCount)
+            {
+                printf("Nothing changed in playlist\n\n");
+                continue;
+            }
 
-            copy->sampleCount++;
-            total_count++;
+            // Crossfade into the changed part (or fade out if it was removed) belongs to the part before
+            start = playlist;
+            for (int p = 1; p < position; p++)
+            {
+                start = start->next;
+            }
 
-            // Process bar
-            if (total_count > (total / total_division) * total_process)
+            // Sizes for new playlist, rewrite RIFF and data chunk sizes in place
+            output->data.ckSize = ((trackCount * samplesPart) - (trackCount - 1) * samplesFade) * output->fmt.nBlockAlign;
+            output->riff.ckSize = sizeof(WAVE) + sizeof(RIFF) + 4 + output->fmt.ckSize + sizeof(DATA) + 4 + output->data.ckSize;
+            output->trackDuration = (float) output->data.ckSize / output->fmt.nAvgBytesPerSec;
+            fseek(output->audiofile, 0, SEEK_SET);
+            fwrite(&output->riff, sizeof(RiffChunk), 1, output->audiofile);
+            fwrite(&output->fmt, sizeof(FmtChunk), 1, output->audiofile);
+            fwrite(&output->data, sizeof(DataChunk), 1, output->audiofile);
+            fflush(output->audiofile);
+            fallocate(fileno(output->audiofile), FALLOC_FL_KEEP_SIZE, 0, output->riff.ckSize + 8); // Harmless if it fails
+
+            // Render from first changed part on, drop what is left of the old medley
+            printf("\nCreating medley again from No %i - %s:\n", start->trackNumber, start->name);
+            fseek(output->audiofile, sizeof(RiffChunk) + sizeof(FmtChunk) + sizeof(DataChunk) + trackOffset(start) * output->fmt.nBlockAlign,
+                  SEEK_SET);
+            renderMedley(playlist, output, start, cflag);
+            fflush(output->audiofile);
+            ftruncate(fileno(output->audiofile), output->riff.ckSize + 8);
+
+            printf("\n\nUpdated your %.0f second \033[0;31mm\033[0;32me\033[0;34md\033[0;36ml\033[0;35me\033[0;33my\033[0m: ./%s\n\n",
+                   output->trackDuration, wflag);
+
+            // Remember rendered parts
+            uint64_t *keys = realloc(rendered, trackCount * sizeof(uint64_t));
+            if (keys == NULL)
+            {
+                printf("\033[0;31m[ERROR]\033[0m Couldn't allocate memory for watching.\n\nAbort! Let Martin know about this...\n\n");
+                status = 2;
+                break;
+            }
+            rendered = keys;
+            renderedCount = trackCount;
+            position = 0;
+            for (Track *part = playlist; part != NULL; part = part->next)
             {
-                total_process++;
-                printf("█");
-                fflush(stdout);
+                rendered[position++] = trackKey(part);
+                part->changed = 0;
             }
         }
-        copy = copy->next;
+        free(rendered);
+        close(notify);
     }
 
-    printf("\n\nEnjoy your %.0f second \033[0;31mm\033[0;32me\033[0;34md\033[0;36ml\033[0;35me\033[0;33my\033[0m: ./%s\n\n",
-           output->trackDuration, wflag);
 
-    // Close output file
-    fclose(output->audiofile);
+    // Close output file (direct output is closed already)
+    if (output->audiofile != NULL)
+    {
+        fclose(output->audiofile);
+    }
 
     // Free output track
     free(output);
 
-    // Clear playlist and free memory
-    deleteTrack(playlist);
+    // Clear playlist and free memory (watch mode may have emptied it)
+    if (playlist != NULL)
+    {
+        deleteTrack(playlist);
+    }
 
     // End of main
-    return 0;
+    return status;
 }
 
 
@@ -857,6 +1365,9 @@ void deleteTrack(Track *track)
 
     // Close audiofile
     fclose(track->audiofile);
+    freeFlac(track->flac);
+    freeStretch(track);
+    freePreview(track);
 
     // Free the malloc'ed path string
     free(track->path);
@@ -880,25 +1391,3860 @@ void numberTracks(Track *playlist)
 }
 
 
-// DEBUG: Print order of playlist
-void printTracks(Track *playlist)
+// Insert track into playlist, case-insensitive by name, returns head of playlist
+Track *insertTrack(Track *playlist, Track *new)
 {
-    printf("\n\nORDER 1:\n");
-    Track *temp = playlist;
-    while (temp != NULL)
+    // First track becomes head of playlist
+    if (playlist == NULL)
     {
-        if (temp->name != NULL)
+        return new;
+    }
+
+    // Search pointer travels thru playlist
+    Track *search = playlist;
+    while (search != NULL)
+    {
+        // Sort case-insensitive by name
+        if (strcasecmp(new->name, search->name) < 0)
         {
-            printf("No %i: %s | prev: %s | next: %s\n", temp->trackNumber, temp->name, temp->prev == NULL ? "NULL" : temp->prev->name,
-                   temp->next == NULL ? "NULL" : temp->next->name);
+            // Put new before search
+            if (search->prev != NULL)
+            {
+                search->prev->next = new;
+                new->prev = search->prev;
+                search->prev = new;
+                new->next = search;
+            }
+            // Put new to head of playlist
+            else
+            {
+                playlist->prev = new;
+                new->next = playlist;
+                playlist = new;
+            }
+            break;
         }
-        else
+        // Put new to end of playlist
+        if (search->next == NULL)
         {
-            printf("No Name\n");
+            search->next = new;
+            new->prev = search;
+            break;
         }
-        temp = temp->next;
+        search = search->next;
     }
-    printf("\n\n");
+    return playlist;
+}
+
+
+// Unlink track from playlist, close its file and free it, returns head of playlist
+Track *removeTrack(Track *playlist, Track *delete)
+{
+    // Remove if only one track in list
+    if (delete->next == NULL && delete->prev == NULL)
+    {
+        playlist = NULL;
+    }
+    // Remove from head of list (no previous)
+    else if (delete->prev == NULL)
+    {
+        playlist = delete->next;
+        playlist->prev = NULL;
+    }
+    // Remove from end of list (no next)
+    else if (delete->next == NULL)
+    {
+        delete->prev->next = NULL;
+    }
+    // Remove from middle of list
+    else
+    {
+        delete->next->prev = delete->prev;
+        delete->prev->next = delete->next;
+    }
+
+    // Close audiofile
+    if (delete->audiofile != NULL)
+    {
+        fclose(delete->audiofile);
+    }
+    freeFlac(delete->flac);
+    freeStretch(delete);
+
+    // Free memory
+    free(delete->path);
+    free(delete);
+    return playlist;
+}
+
+
+// Open track file and read its chunks (or FLAC STREAMINFO), check format and length
+// Returns 1 if the track is to be skipped, 0 if it is valid
+int probeTrack(Track *play, Track *output, float iflag, float dflag, float xflag)
+{
+    // Invalid file, remove from playlist
+    int skipFlag = 0;
+
+    // Open file for reading
+    play->audiofile = fopen(play->path, "r");
+
+    // Helper loop for error handling (break on skipFlag)
+    do
+    {
+        // STATUS PRINT: ID and name
+        printf("No %i - %s ", play->trackNumber, play->name);
+
+        // Handle file write access error
+        if (play->audiofile == NULL)
+        {
+            printf("\033[0;31m[ERROR]\033[0m Could not open file at %s\n", play->path);
+            skipFlag = 1;
+            break;
+        }
+
+        // Handle RIFF header
+        fread(&play->riff, sizeof(RiffChunk), 1, play->audiofile);
+
+        // Handle FLAC: format and length from STREAMINFO, no chunks to walk
+        if (play->riff.ckID == FLAC)
+        {
+            if (readStreamInfo(play) != 0)
+            {
+                printf("\033[0;33m[SKIPPED]\033[0m No valid FLAC STREAMINFO found, file corruption\n");
+                skipFlag = 1;
+            }
+            else if (checkFormat(play, output) || checkData(play, output, iflag, dflag, xflag))
+            {
+                skipFlag = 1;
+            }
+            break;
+        }
+
+        if (play->riff.ckID != RIFF)
+        {
+            printf("\033[0;33m[SKIPPED]\033[0m Only RIFF Files are supported\n");
+            skipFlag = 1;
+            break;
+        }
+
+        // Handle WAVE header
+        if (play->riff.riffType != WAVE)
+        {
+            printf("\033[0;33m[SKIPPED]\033[0m Only PCM Files are supported\n");
+            skipFlag = 1;
+            break;
+        }
+
+
+
+// ----------------------------------------------------------
+// R E A D I N G   C H U N K S
+// Read chunks (ckID, chSize) till fmt & data chunk is found
+// Ignore and skip all other chunks, e.g. BEXT chunk (BWF)
+// ----------------------------------------------------------
+
+
+        do
+        {
+            // Handle padding, skip NUL character(s)
+            char check_padding;
+            fread(&check_padding, sizeof(char), 1, play->audiofile);
+            if (check_padding == 0) // Probe for NUL
+            {
+                continue;
+            }
+            else    // Rewind last fread and continue if not NUL
+            {
+                fseek(play->audiofile, -sizeof(char), SEEK_CUR);
+            }
+
+            // Check for chunkID
+            DWORD check_Id;
+            fread(&check_Id, sizeof(DWORD), 1, play->audiofile);
+
+            // Check for chunkSize
+            DWORD ckSize;
+            fread(&ckSize, sizeof(DWORD), 1, play->audiofile);
+
+// ----------------------------------------------------------
+// F O R M A T   C H U N K
+// ----------------------------------------------------------
+
+            if (check_Id == FMT)
+            {
+                fseek(play->audiofile, -sizeof(DWORD) * 2, SEEK_CUR);
+                fread(&play->fmt, sizeof(FmtChunk), 1, play->audiofile);
+
+                // Validate format, first track sets the master
+                if (checkFormat(play, output))
+                {
+                    skipFlag = 1;
+                    break;
+                }
+
+                // Move *audiofile to end of fmt chunk (skipping padding bytes if there are any)
+                fseek(play->audiofile, -sizeof(FmtChunk) + 2 * sizeof(DWORD) + play->fmt.ckSize, SEEK_CUR);
+
+                // Continue to search for data chunk
+                continue;
+            }
+
+// ----------------------------------------------------------
+// D A T A   C H U N K
+// ----------------------------------------------------------
+
+            if (check_Id == DATA)
+            {
+                play->data.ckID = check_Id;
+                play->data.ckSize = ckSize;
+                play->dataOffset = ftell(play->audiofile);
+
+                // Validate length, first track sets the globals
+                if (checkData(play, output, iflag, dflag, xflag))
+                {
+                    skipFlag = 1;
+                    break;
+                }
+
+                // Valid track, no skipFlag
+                break;
+            }
+
+            // Reject RF64 BWF (encountered ds64 chunk)
+            if (check_Id == DS64)
+            {
+                printf("\033[0;33m[SKIPPED]\033[0m RF64 BWF is not supported\n");
+                skipFlag = 1;
+                break;
+            }
+
+            // Check for reaching End Of File
+            if (feof(play->audiofile))
+            {
+                printf("\033[0;33m[SKIPPED]\033[0m No audio data found, file corruption\n");
+                skipFlag = 1;
+                break;
+            }
+
+            // Skip all other chunks
+            fseek(play->audiofile, ckSize, SEEK_CUR);
+
+        }
+        while (skipFlag == 0);
+
+        // Break helper loop when track is valid
+        break;
+
+    }
+    while (1);
+
+    return skipFlag;
+}
+
+
+// Check format of track: 16 bit, mono or stereo, matching the first track (master)
+// Returns 1 if track has to be skipped
+int checkFormat(Track *play, Track *output)
+{
+    // Only allow 16 bit files -> sample allways holds int16_t
+    // 8 Bit: require unsigned integer uint8_t
+    // 24 bit: require non-primitive datatype int24_t
+    // 32 bit: require floating point arithmethic
+    if (play->fmt.wBitsPerSample != 16)
+    {
+        printf("\033[0;33m[SKIPPED]\033[0m Only 16 bit files are supported, %i bit are not\n", play->fmt.wBitsPerSample);
+        return 1;
+    }
+
+    // Reject surround wave files
+    if (play->fmt.nChannels > 2)
+    {
+        printf("\033[0;33m[SKIPPED]\033[0m Multichannel files are not supported\n");
+        return 1;
+    }
+
+    // Set fmt data to master if this is the first track (never once output is written)
+    if (trackCount == 0 && !formatFixed)
+    {
+        output->fmt = play->fmt;
+    }
+    // Validate all other tracks against the master and reject if format does not match
+    else
+    {
+        if (output->fmt.nChannels != play->fmt.nChannels)
+        {
+            printf("\033[0;33m[SKIPPED]\033[0m Channel count (%hu Ch) does not match first track (%hu Ch)\n", play->fmt.nChannels,
+                   output->fmt.nChannels);
+            return 1;
+        }
+        else if (output->fmt.nSamplesPerSec != play->fmt.nSamplesPerSec)
+        {
+            printf("\033[0;33m[SKIPPED]\033[0m Samplerate (%u Hz) does not match first track (%u Hz)\n", play->fmt.nSamplesPerSec,
+                   output->fmt.nSamplesPerSec);
+            return 1;
+        }
+        else if (output->fmt.wBitsPerSample != play->fmt.wBitsPerSample)
+        {
+            printf("\033[0;33m[SKIPPED]\033[0m Bit depth (%hu bit) does not match first track (%hu bit)\n", play->fmt.wBitsPerSample,
+                   output->fmt.wBitsPerSample);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+// Check length of track and set globals from first track
+// Returns 1 if track has to be skipped
+int checkData(Track *play, Track *output, float iflag, float dflag, float xflag)
+{
+    // Calculate trackDuration in seconds
+    play->trackDuration = (float) play->data.ckSize * 8 / (play->fmt.nChannels * play->fmt.nSamplesPerSec * play->fmt.wBitsPerSample);
+
+    // Check for in-mark within track duration
+    if (iflag > play->trackDuration)
+    {
+        printf("\033[0;31m[ERROR]\033[0m In-marker (%.2f) outside of track (%.2f)\n", iflag, play->trackDuration);
+        // printf("\033[0;31m[ERROR]\033[0m In-marker %s\n", play->path);
+        return 1;
+    }
+
+    // Calculate globals as first valid track is found (i.e. valid fmt chunk and valid data chunk)
+    if (trackCount == 0 && !formatFixed)
+    {
+        samplesIn = iflag * output->fmt.nSamplesPerSec;
+        samplesPart = dflag * output->fmt.nSamplesPerSec;
+        samplesFade = xflag * output->fmt.nSamplesPerSec;
+    }
+
+    // FF pointer to in marker (auto in-marker seeks again after analysis)
+    play->markerIn = samplesIn;
+    seekTrack(play);
+
+    return 0;
+}
+
+
+// Limit sample to 16 bit range instead of wrapping around
+int16_t clip16(double sample)
+{
+    if (sample > INT16_MAX)
+    {
+        return INT16_MAX;
+    }
+    if (sample < INT16_MIN)
+    {
+        return INT16_MIN;
+    }
+    return (int16_t) sample;
+}
+
+
+// Shared cursor of worker threads walking thru the playlist
+typedef struct TrackQueue
+{
+    Track *next;                // Next track to be processed
+    void (*task)(Track *track); // Work to do per track
+    int changedOnly;            // Skip tracks not changed since last render
+    pthread_mutex_t lock;       // Guards next
+}
+TrackQueue;
+
+
+// Worker thread: take tracks from queue until playlist is done
+void *trackWorker(void *arg)
+{
+    TrackQueue *queue = arg;
+    while (1)
+    {
+        pthread_mutex_lock(&queue->lock);
+        Track *track = queue->next;
+        if (track != NULL)
+        {
+            queue->next = track->next;
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        if (track == NULL)
+        {
+            return NULL;
+        }
+        if (track->changed || !queue->changedOnly)
+        {
+            queue->task(track);
+        }
+    }
+}
+
+
+// Run task on every (or every changed) track of the playlist, one worker thread per CPU core
+void processTracks(Track *playlist, void (*task)(Track *track), int changedOnly)
+{
+    TrackQueue queue = {playlist, task, changedOnly, PTHREAD_MUTEX_INITIALIZER};
+
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers > trackCount)
+    {
+        workers = trackCount;
+    }
+    if (workers < 1)
+    {
+        workers = 1;
+    }
+
+    pthread_t threads[workers];
+    long started = 0;
+    while (started < workers && pthread_create(&threads[started], NULL, trackWorker, &queue) == 0)
+    {
+        started++;
+    }
+
+    // Help out (or do all the work if no thread could be started)
+    trackWorker(&queue);
+
+    for (long t = 0; t < started; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    pthread_mutex_destroy(&queue.lock);
+}
+
+
+// Measure integrated loudness of a track according to ITU-R BS.1770 (EBU R128)
+// K-weighted mean square in 100 ms steps, 400 ms gating blocks, absolute and relative gate
+void measureLoudness(Track *track)
+{
+    int channels = track->fmt.nChannels;
+    long rate = track->fmt.nSamplesPerSec;
+    long frames = track->data.ckSize / track->fmt.nBlockAlign;
+    track->loudness = -INFINITY;
+
+    // Slice going into the medley (fades included) or the whole track
+    long first = wholeTrack ? 0 : track->markerIn;
+    long last = wholeTrack ? frames : track->markerIn + samplesPart;
+    if (last > frames)
+    {
+        last = frames;
+    }
+
+    // Step of 100 ms, four steps make one gating block (75% overlap)
+    long step = rate / 10;
+    long steps = (last - first) / step;
+    if (steps < 4)
+    {
+        return;
+    }
+
+    double *energy = calloc(steps, sizeof(double));
+    int16_t *buffer = malloc(step * track->fmt.nBlockAlign);
+    if (energy == NULL || buffer == NULL)
+    {
+        free(energy);
+        free(buffer);
+        return;
+    }
+
+    // K-weighting stage 1: high shelf modelling the head (coefficients for any sample rate)
+    double K = tan(M_PI * 1681.974450955533 / rate);
+    double Vh = pow(10, 3.999843853973347 / 20);
+    double Vb = pow(Vh, 0.4996667741545416);
+    double Q = 0.7071752369554196;
+    double a0 = 1 + K / Q + K * K;
+    double sb0 = (Vh + Vb * K / Q + K * K) / a0;
+    double sb1 = 2 * (K * K - Vh) / a0;
+    double sb2 = (Vh - Vb * K / Q + K * K) / a0;
+    double sa1 = 2 * (K * K - 1) / a0;
+    double sa2 = (1 - K / Q + K * K) / a0;
+
+    // K-weighting stage 2: RLB high pass
+    K = tan(M_PI * 38.13547087602444 / rate);
+    Q = 0.5003270373238773;
+    a0 = 1 + K / Q + K * K;
+    double ha1 = 2 * (K * K - 1) / a0;
+    double ha2 = (1 - K / Q + K * K) / a0;
+
+    // Filter state per channel (transposed direct form II)
+    double state[2][4] = {{0}};
+
+    seekSample(track, first);
+    for (long s = 0; s < steps; s++)
+    {
+        if (readFrames(track, buffer, step) != step)
+        {
+            steps = s;
+            break;
+        }
+
+        // Filter one channel at a time over the whole step, state stays in registers
+        for (int c = 0; c < channels; c++)
+        {
+            double z0 = state[c][0], z1 = state[c][1], z2 = state[c][2], z3 = state[c][3];
+            double sum = 0;
+            for (long f = 0; f < step; f++)
+            {
+                double x = buffer[f * channels + c] / 32768.0;
+                double y = sb0 * x + z0;
+                z0 = sb1 * x - sa1 * y + z1;
+                z1 = sb2 * x - sa2 * y;
+                double k = y + z2;
+                z2 = -2 * y - ha1 * k + z3;
+                z3 = y - ha2 * k;
+                sum += k * k;
+            }
+            state[c][0] = z0, state[c][1] = z1, state[c][2] = z2, state[c][3] = z3;
+            energy[s] += sum / step;
+        }
+    }
+    free(buffer);
+
+    // Absolute gate at -70 LUFS, relative gate 10 LU below the absolute gated mean
+    double gate = pow(10, (-70 + 0.691) / 10);
+    for (int pass = 0; pass < 2; pass++)
+    {
+        double sum = 0;
+        long count = 0;
+        for (long b = 0; b + 3 < steps; b++)
+        {
+            double block = (energy[b] + energy[b + 1] + energy[b + 2] + energy[b + 3]) / 4;
+            if (block > gate)
+            {
+                sum += block;
+                count++;
+            }
+        }
+        if (count == 0)
+        {
+            break;
+        }
+        if (pass == 0)
+        {
+            gate = fmax(gate, sum / count / 10);
+        }
+        else
+        {
+            track->loudness = -0.691 + 10 * log10(sum / count);
+        }
+    }
+    free(energy);
+}
+
+
+// Render playlist from track first (its part after the crossfade into it) to the end,
+// output file must be positioned at trackOffset(first)
+void renderMedley(Track *playlist, Track *output, Track *first, char *cflag)
+{
+    // Transfer one frame (bit depth * channel) from audiofile -> writefile
+    // Rendering is in format of the playlist, previews render mono at the preview rate
+    int channels = playlist->preview != NULL ? 1 : playlist->fmt.nChannels;
+    int16_t transfer_main[channels];
+
+    // Read raw audio from playlist, starting at first
+    Track *copy = first;
+
+    // Read positions: first track continues after the crossfade into it, all later ones start fresh
+    for (Track *reset = first; reset != NULL; reset = reset->next)
+    {
+        reset->sampleCount = 0;
+    }
+    if (first->trackNumber > 1 && samplesFade > 0)
+    {
+        first->sampleCount = first->prev->stretch != NULL ? first->prev->stretch->consumed : samplesFade - 1;
+    }
+
+    // Total samples (from first on) and count of medley for process bar
+    long total = (trackCount * samplesPart) - (trackCount - 1) * samplesFade - trackOffset(first);
+    long total_count = 0;
+    int total_division = 40;
+    int total_process = 0;
+
+    // Segments taken from cache and segments in total
+    int cached = 0;
+    int segments = 0;
+    char cachePath[cflag == NULL ? 1 : strlen(cflag) + 32];
+    char tempPath[cflag == NULL ? 1 : strlen(cflag) + 32];
+
+    // Loop thru playlist and copy audio data to output, segment by segment:
+    // part of the track (incl. fade in and fade out) and crossfade into next track
+    while (copy != NULL)
+    {
+        // Skip fade in on all but first track
+        long bounds[3];
+        bounds[0] = copy->trackNumber > 1 ? samplesFade : 0;
+        bounds[1] = copy->next != NULL && samplesFade > 0 ? samplesPart - samplesFade + 1 : samplesPart;
+        bounds[2] = samplesPart;
+
+        for (int segment = 0; segment < 2; segment++)
+        {
+            long from = bounds[segment];
+            long to = bounds[segment + 1];
+            if (from >= to)
+            {
+                continue;
+            }
+            segments++;
+
+            // Segment in cache: copy it and forward file pointers as if it was rendered
+            FILE *cacheFile = NULL;
+            if (cflag != NULL)
+            {
+                sprintf(cachePath, "%s/%016" PRIx64 ".pcm", cflag, segmentKey(copy, segment ? copy->next : NULL, from, to));
+                sprintf(tempPath, "%s.tmp", cachePath);
+                if (copyCached(cachePath, output, (to - from) * sizeof(transfer_main), sizeof(transfer_main)))
+                {
+                    copy->sampleCount += to - from;
+                    if (segment)
+                    {
+                        copy->next->sampleCount = copy->stretch != NULL ? copy->stretch->consumed : copy->next->sampleCount + to - from;
+                    }
+                    cached++;
+                    total_count += to - from;
+                    while (total_count > (total / total_division) * total_process)
+                    {
+                        total_process++;
+                        printf("█");
+                    }
+                    fflush(stdout);
+                    continue;
+                }
+
+                // Otherwise render into cache as well
+                cacheFile = fopen(tempPath, "w");
+            }
+
+            // Source files may lag behind after cached segments
+            seekTrack(copy);
+            if (segment)
+            {
+                seekTrack(copy->next);
+            }
+
+            for (long i = from; i < to; i++)
+            {
+                // Tempo-matched crossfade is rendered already
+                if (segment && copy->stretch != NULL)
+                {
+                    memcpy(transfer_main, copy->stretch->frames + (i - from) * channels, sizeof(transfer_main));
+                }
+                else
+                {
+                    renderFrame(copy, i, transfer_main);
+                }
+
+                writeFrames(output, transfer_main, 1);
+                if (cacheFile != NULL)
+                {
+                    fwrite(&transfer_main, sizeof(int16_t), channels, cacheFile);
+                }
+
+                total_count++;
+
+                // Process bar
+                if (total_count > (total / total_division) * total_process)
+                {
+                    total_process++;
+                    printf("█");
+                    fflush(stdout);
+                }
+            }
+
+            if (segment && copy->stretch != NULL)
+            {
+                copy->sampleCount += to - from;
+                copy->next->sampleCount = copy->stretch->consumed;
+            }
+
+            // Publish complete segments only
+            if (cacheFile != NULL)
+            {
+                if (fclose(cacheFile) == 0)
+                {
+                    rename(tempPath, cachePath);
+                }
+                else
+                {
+                    remove(tempPath);
+                }
+            }
+        }
+        copy = copy->next;
+    }
+
+    if (cflag != NULL)
+    {
+        printf("\n\n%i of %i segments taken from cache %s", cached, segments, cflag);
+    }
+}
+
+
+// Output sample where the part of a track starts after the crossfade into it
+long trackOffset(Track *track)
+{
+    return (track->trackNumber - 1) * (samplesPart - samplesFade) + (track->trackNumber > 1 ? samplesFade : 0);
+}
+
+
+// Read frame at position i of the part of track copy, apply fades and gain, mix with next track in crossfade
+void renderFrame(Track *copy, long i, int16_t *transfer_main)
+{
+    int channels = copy->preview != NULL ? 1 : copy->fmt.nChannels;
+    int16_t transfer_fade[channels];
+
+    // FADE IN
+    if (i < samplesFade)
+    {
+        readPart(copy, transfer_main);
+
+        for (int j = 0; j < channels; j++)
+        {
+            // Linear Fade In
+            // transfer_main[j] = transfer_main[j] * (float)i / samplesFade;
+
+            // Squareroot Fade In
+            transfer_main[j] = clip16(transfer_main[j] * copy->gain * sqrt((float)i / samplesFade));
+        }
+
+        // DEBUG
+        // printf("\n[%li] %li / %li : %i @ %li IN ", total_count, i, samplesPart, copy->trackNumber, copy->sampleCount);
+    }
+    else if (i > samplesPart - samplesFade)
+    {
+        // CROSSFADE
+        if (copy->next != NULL)
+        {
+            readPart(copy, transfer_main);
+            readPart(copy->next, transfer_fade);
+
+            for (int j = 0; j < channels; j++)
+            {
+                // Linear cross fade
+                // transfer_main[j] = transfer_main[j] * (1 - (float)(i - samplesPart + samplesFade) / samplesFade);
+                // transfer_fade[j] = transfer_fade[j] * (float)(i - samplesPart + samplesFade) / samplesFade;
+
+                // Squareroot fade out
+                transfer_main[j] = clip16(transfer_main[j] * copy->gain * sqrt(1 - (float)(i - samplesPart + samplesFade) / samplesFade));
+                transfer_fade[j] = clip16(transfer_fade[j] * copy->next->gain * sqrt((float)(i - samplesPart + samplesFade) / samplesFade));
+
+                // Summing
+                transfer_main[j] = clip16(transfer_main[j] + transfer_fade[j]);
+            }
+
+            // DEBUG
+            // printf("\n[%li] %li / %li : %i @ %li XX %i @ %li", total_count, i, samplesPart, copy->trackNumber, copy->sampleCount, copy->next->trackNumber, copy->next->sampleCount);
+
+            // Forward X-fade file
+            copy->next->sampleCount++;
+        }
+        // FADE OUT
+        else
+        {
+            readPart(copy, transfer_main);
+
+            for (int j = 0; j < channels; j++)
+            {
+                // Linear fade out
+                // transfer_main[j] = transfer_main[j] * (1 - (float)(i - samplesPart + samplesFade) / samplesFade);
+
+                // Squareroot fade out
+                transfer_main[j] = clip16(transfer_main[j] * copy->gain * sqrt(1 - (float)(i - samplesPart + samplesFade) / samplesFade));
+            }
+
+            // DEBUG
+            // printf("\n[%li of %li] %li / %li : %i @ %li OUT", total_count, total, i, samplesPart, copy->trackNumber, copy->sampleCount);
+        }
+    }
+    // SOLO TRACK
+    else
+    {
+        readPart(copy, transfer_main);
+
+        // Normalization gain, unity if disabled
+        if (copy->gain != 1)
+        {
+            for (int j = 0; j < channels; j++)
+            {
+                transfer_main[j] = clip16(transfer_main[j] * copy->gain);
+            }
+        }
+
+        // DEBUG
+        // printf("\n[%li] %li / %li : %i @ %li --", total_count, i, samplesPart, copy->trackNumber, copy->sampleCount);
+    }
+
+    copy->sampleCount++;
+}
+
+
+// Move file pointer of track to its current sample (in-marker + samples read)
+void seekTrack(Track *track)
+{
+    // Preview reads by position
+    if (track->preview != NULL)
+    {
+        return;
+    }
+    seekSample(track, track->markerIn + track->sampleCount);
+}
+
+
+// Move file pointer of track to sample, FLAC seeks on next read
+void seekSample(Track *track, long sample)
+{
+    if (track->flac != NULL)
+    {
+        track->flac->target = sample;
+        return;
+    }
+    fseek(track->audiofile, track->dataOffset + sample * track->fmt.nBlockAlign, SEEK_SET);
+}
+
+
+// Write rendered frames to output, thru preview if there is one
+void writeFrames(Track *output, int16_t *frames, long count)
+{
+    if (output->preview != NULL)
+    {
+        previewFrames(output, frames, count);
+        return;
+    }
+    emitFrames(output, frames, count);
+}
+
+
+// Write frames in output format: raw PCM to wave file or blocks to FLAC encoder
+void emitFrames(Track *output, void *data, long count)
+{
+    FlacEncoder *encoder = output->encoder;
+    if (encoder == NULL)
+    {
+        writeBytes(output, data, count * output->fmt.nBlockAlign);
+        return;
+    }
+
+    int16_t *frames = data;
+
+    while (count > 0)
+    {
+        EncodeBatch *batch = &encoder->batch[encoder->filling];
+        long filled = encoder->samples % encoder->blockSize;
+        long n = encoder->blockSize - filled < count ? encoder->blockSize - filled : count;
+        memcpy(batch->pcm + (batch->count * encoder->blockSize + filled) * encoder->channels, frames, n * output->fmt.nBlockAlign);
+        encoder->samples += n;
+        frames += n * encoder->channels;
+        count -= n;
+
+        // Block complete, batch complete: hand over to workers
+        if (filled + n == encoder->blockSize)
+        {
+            batch->frames[batch->count++] = encoder->blockSize;
+            if (batch->count == 64)
+            {
+                submitBatch(encoder);
+            }
+        }
+    }
+}
+
+
+// Read frames (one sample per channel) of wave or FLAC track, returns frames read
+long readFrames(Track *track, int16_t *buffer, long frames)
+{
+    FlacStream *flac = track->flac;
+    if (flac == NULL)
+    {
+        return fread(buffer, track->fmt.nBlockAlign, frames, track->audiofile);
+    }
+
+    if (flac->target >= 0)
+    {
+        flacSeek(flac, flac->target);
+        flac->target = -1;
+    }
+
+    long done = 0;
+    while (done < frames)
+    {
+        if (flac->blockPos >= flac->blockFrames && !nextBlock(flac))
+        {
+            // End of stream: silence
+            memset(buffer + done * track->fmt.nChannels, 0, (frames - done) * track->fmt.nBlockAlign);
+            break;
+        }
+        long n = flac->blockFrames - flac->blockPos < frames - done ? flac->blockFrames - flac->blockPos : frames - done;
+        memcpy(buffer + done * track->fmt.nChannels, flac->block + flac->blockPos * track->fmt.nChannels, n * track->fmt.nBlockAlign);
+        flac->blockPos += n;
+        done += n;
+    }
+    return done;
+}
+
+
+// FNV-1a hash over some bytes
+uint64_t hashBytes(uint64_t hash, void *data, size_t size)
+{
+    BYTE *bytes = data;
+    for (size_t b = 0; b < size; b++)
+    {
+        hash = (hash ^ bytes[b]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+
+// Cache key of an output segment: identity of the source file(s) (device, inode, size, mtime),
+// read position and gain, plus every parameter shaping the audio of the segment (incl. tempo match, preview)
+uint64_t segmentKey(Track *track, Track *fade, long from, long to)
+{
+    long params[] = {CACHE_VERSION, from, to, samplesPart, samplesFade, track->next == NULL,
+                     track->fmt.nChannels, track->fmt.nSamplesPerSec, track->fmt.wBitsPerSample,
+                     track->preview != NULL ? track->preview->factor : 1
+                    };
+    uint64_t hash = hashBytes(0xcbf29ce484222325, params, sizeof(params));
+
+    Track *sources[2] = {track, fade};
+    for (int s = 0; s < 2 && sources[s] != NULL; s++)
+    {
+        struct stat info;
+        fstat(fileno(sources[s]->audiofile), &info);
+        long identity[] = {info.st_dev, info.st_ino, info.st_size, info.st_mtim.tv_sec, info.st_mtim.tv_nsec,
+                           sources[s]->markerIn, sources[s]->sampleCount,
+                           sources[s]->preview != NULL ? sources[s]->preview->phase : 0
+                          };
+        hash = hashBytes(hash, identity, sizeof(identity));
+        hash = hashBytes(hash, &sources[s]->gain, sizeof(float));
+    }
+
+    // Tempo-matched crossfade
+    if (fade != NULL && track->stretch != NULL)
+    {
+        hash = hashBytes(hash, &track->stretch->ratio, sizeof(float));
+    }
+    return hash;
+}
+
+
+// Append cached segment to output, 0 if there is no complete cache entry
+int copyCached(char *path, Track *output, long bytes, int blockAlign)
+{
+    FILE *out = output->audiofile;
+    int in = open(path, O_RDONLY);
+    if (in < 0)
+    {
+        return 0;
+    }
+    struct stat info;
+    if (fstat(in, &info) != 0 || info.st_size != bytes)
+    {
+        close(in);
+        return 0;
+    }
+
+    // FLAC, preview or direct output: cached PCM goes thru the encoder, preview or aligned buffer
+    // Frames can't be taken back once handed on, so the whole segment is read first
+    if (output->encoder != NULL || output->preview != NULL || output->direct != NULL)
+    {
+        int16_t *frames = malloc(bytes);
+        long done = 0;
+        ssize_t n;
+        while (frames != NULL && done < bytes && (n = pread(in, (BYTE *) frames + done, bytes - done, done)) > 0)
+        {
+            done += n;
+        }
+        close(in);
+        if (frames == NULL || done != bytes)
+        {
+            free(frames);
+            return 0;
+        }
+        writeFrames(output, frames, bytes / blockAlign);
+        free(frames);
+        return 1;
+    }
+
+    // Let the kernel copy (or share extents), fall back to read and write
+    fflush(out);
+    int fd = fileno(out);
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    long done = 0;
+    ssize_t n;
+    while (done < bytes && (n = copy_file_range(in, NULL, fd, NULL, bytes - done, 0)) > 0)
+    {
+        done += n;
+    }
+    char buffer[65536];
+    while (done < bytes && (n = pread(in, buffer, bytes - done < 65536 ? bytes - done : 65536, done)) > 0)
+    {
+        if (write(fd, buffer, n) != n)
+        {
+            break;
+        }
+        done += n;
+    }
+    close(in);
+
+    // Roll back partial copy
+    if (done != bytes)
+    {
+        ftruncate(fd, start);
+        fseek(out, start, SEEK_SET);
+        return 0;
+    }
+    fseek(out, start + bytes, SEEK_SET);
+    return 1;
+}
+
+
+// Find the most energetic window of one part length and set the in-marker there (-i auto)
+// One streaming pass in hops of 20 ms: RMS of a decimated low band and of a high band
+// (first difference) plus their rise from the previous hop (band-wise spectral flux)
+// make the score of a hop, only one part length of scores is kept in a ring buffer
+void findMarker(Track *track)
+{
+    int channels = track->fmt.nChannels;
+    long frames = track->data.ckSize / track->fmt.nBlockAlign;
+    long hop = track->fmt.nSamplesPerSec / 50;
+    long window = samplesPart / hop > 0 ? samplesPart / hop : 1;
+    long hops = frames / hop;
+    track->markerIn = 0;
+
+    float *score = calloc(window, sizeof(float));
+    float *mono = malloc(hop * sizeof(float));
+    int16_t *buffer = malloc(hop * track->fmt.nBlockAlign);
+    if (hops > window && score != NULL && mono != NULL && buffer != NULL)
+    {
+        double running = 0;
+        double best = -1;
+        float prevLow = 0;
+        float prevHigh = 0;
+
+        seekSample(track, 0);
+        for (long h = 0; h < hops; h++)
+        {
+            if (readFrames(track, buffer, hop) != hop)
+            {
+                break;
+            }
+
+            // Downmix to mono
+            if (channels == 2)
+            {
+                for (long f = 0; f < hop; f++)
+                {
+                    mono[f] = (buffer[2 * f] + buffer[2 * f + 1]) * 0.5f;
+                }
+            }
+            else
+            {
+                for (long f = 0; f < hop; f++)
+                {
+                    mono[f] = buffer[f];
+                }
+            }
+
+            // Low band: mean of 8 samples, i.e. decimated by 8
+            float low = 0;
+            for (long f = 0; f + 8 <= hop; f += 8)
+            {
+                float mean = (mono[f] + mono[f + 1] + mono[f + 2] + mono[f + 3] + mono[f + 4] + mono[f + 5] + mono[f + 6] + mono[f + 7]) / 8;
+                low += mean * mean;
+            }
+            low = sqrtf(low / (hop / 8));
+
+            // High band: first difference
+            float high = 0;
+            for (long f = 1; f < hop; f++)
+            {
+                float diff = mono[f] - mono[f - 1];
+                high += diff * diff;
+            }
+            high = sqrtf(high / (hop - 1));
+
+            // Score: energy plus onsets (rise of band energy)
+            float s = low + high + fmaxf(0, low - prevLow) + fmaxf(0, high - prevHigh);
+            prevLow = low;
+            prevHigh = high;
+
+            // Sliding sum over one part length, remember the best window
+            running += s - score[h % window];
+            score[h % window] = s;
+            if (h + 1 >= window && running > best)
+            {
+                best = running;
+                track->markerIn = (h + 1 - window) * hop;
+            }
+        }
+    }
+    free(score);
+    free(mono);
+    free(buffer);
+
+    // Move file pointer to new in-marker
+    seekTrack(track);
+}
+
+
+// Onset envelope of count hops (5 ms) from sample start: rise of log energy of a low band
+// (mean of 8 samples) and a high band (first difference), before start of track is silence
+void onsetEnvelope(Track *track, long start, long count, float *envelope)
+{
+    int channels = track->fmt.nChannels;
+    long hop = track->fmt.nSamplesPerSec / 200;
+    float *mono = malloc(hop * sizeof(float));
+    int16_t *buffer = malloc(hop * track->fmt.nBlockAlign);
+    if (mono == NULL || buffer == NULL)
+    {
+        memset(envelope, 0, count * sizeof(float));
+        free(mono);
+        free(buffer);
+        return;
+    }
+
+    // One extra hop in front for the first rise
+    float prevLow = 0;
+    float prevHigh = 0;
+    int seeked = 0;
+    for (long h = 0; h <= count; h++)
+    {
+        long at = start + (h - 1) * hop;
+        float low = 0;
+        float high = 0;
+        if (at >= 0 && !seeked)
+        {
+            seekSample(track, at);
+            seeked = 1;
+        }
+        if (at >= 0 && readFrames(track, buffer, hop) == hop)
+        {
+            for (long f = 0; f < hop; f++)
+            {
+                mono[f] = channels == 2 ? (buffer[2 * f] + buffer[2 * f + 1]) * 0.5f : buffer[f];
+            }
+            for (long f = 0; f + 8 <= hop; f += 8)
+            {
+                float mean = (mono[f] + mono[f + 1] + mono[f + 2] + mono[f + 3] + mono[f + 4] + mono[f + 5] + mono[f + 6] + mono[f + 7]) / 8;
+                low += mean * mean;
+            }
+            for (long f = 1; f < hop; f++)
+            {
+                float diff = mono[f] - mono[f - 1];
+                high += diff * diff;
+            }
+            low = log1pf(sqrtf(low / (hop / 8)));
+            high = log1pf(sqrtf(high / (hop - 1)));
+        }
+        if (h > 0)
+        {
+            envelope[h - 1] = fmaxf(0, low - prevLow) + fmaxf(0, high - prevHigh);
+        }
+        prevLow = low;
+        prevHigh = high;
+    }
+    free(mono);
+    free(buffer);
+}
+
+
+// Onset envelopes around the fades of a track (beat alignment): head around the in-marker,
+// tail around the start of the crossfade, each one fade plus the shift to both sides
+void measureOnsets(Track *track)
+{
+    long hop = track->fmt.nSamplesPerSec / 200;
+    long fadeHops = samplesFade / hop;
+    long shiftHops = samplesShift / hop;
+    long length = fadeHops + 2 * shiftHops;
+    if (fadeHops < 1)
+    {
+        return;
+    }
+
+    track->onsets = malloc(2 * length * sizeof(float));
+    if (track->onsets != NULL)
+    {
+        onsetEnvelope(track, track->markerIn - shiftHops * hop, length, track->onsets);
+        onsetEnvelope(track, track->markerIn + samplesPart - samplesFade - shiftHops * hop, length, track->onsets + length);
+    }
+
+    // Move file pointer back to in-marker
+    seekTrack(track);
+}
+
+
+// Twiddle factors of a radix-2 FFT of size, one contiguous table per stage:
+// cosines of stage with half length h at [h - 1, 2h - 1), sines size - 1 further
+float *makeTwiddles(long size)
+{
+    float *twiddles = malloc(2 * size * sizeof(float));
+    if (twiddles == NULL)
+    {
+        return NULL;
+    }
+    for (long half = 1; half < size; half <<= 1)
+    {
+        for (long k = 0; k < half; k++)
+        {
+            twiddles[half - 1 + k] = cos(M_PI * k / half);
+            twiddles[size - 1 + half - 1 + k] = -sin(M_PI * k / half);
+        }
+    }
+    return twiddles;
+}
+
+
+// In-place forward FFT of split complex data, size a power of 2
+// Real and imaginary parts in separate arrays, so the butterflies of a stage vectorize
+void fft(float *re, float *im, long size, float *twiddles)
+{
+    // Bit reversed order
+    for (long i = 1, j = 0; i < size; i++)
+    {
+        long bit = size >> 1;
+        for (; j & bit; bit >>= 1)
+        {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j)
+        {
+            float t = re[i];
+            re[i] = re[j];
+            re[j] = t;
+            t = im[i];
+            im[i] = im[j];
+            im[j] = t;
+        }
+    }
+
+    for (long half = 1; half < size; half <<= 1)
+    {
+        float *wr = twiddles + half - 1;
+        float *wi = twiddles + size - 1 + half - 1;
+        for (long i = 0; i < size; i += 2 * half)
+        {
+            float *ar = re + i;
+            float *ai = im + i;
+            float *br = re + i + half;
+            float *bi = im + i + half;
+            for (long k = 0; k < half; k++)
+            {
+                float tr = br[k] * wr[k] - bi[k] * wi[k];
+                float ti = br[k] * wi[k] + bi[k] * wr[k];
+                br[k] = ar[k] - tr;
+                bi[k] = ai[k] - ti;
+                ar[k] += tr;
+                ai[k] += ti;
+            }
+        }
+    }
+}
+
+
+// Move in-marker of every next track so its onsets line up with the tail of the track before
+// Cross-correlation of onset envelopes via FFT: tail (mean removed) and head are packed into
+// one complex transform as real and imaginary part, the cross spectrum is transformed back
+void alignBeats(Track *playlist)
+{
+    long hop = playlist->fmt.nSamplesPerSec / 200;
+    long fadeHops = samplesFade / hop;
+    long shiftHops = samplesShift / hop;
+    long length = fadeHops + 2 * shiftHops;
+    long size = 1;
+    while (size < length)
+    {
+        size <<= 1;
+    }
+
+    float *re = malloc(size * sizeof(float));
+    float *im = malloc(size * sizeof(float));
+    float *twiddles = makeTwiddles(size);
+
+    // Shift of current track in hops, first track is never moved
+    long shift = 0;
+    for (Track *track = playlist; track != NULL && track->next != NULL; track = track->next)
+    {
+        Track *next = track->next;
+        if (re == NULL || im == NULL || twiddles == NULL || track->onsets == NULL || next->onsets == NULL)
+        {
+            shift = 0;
+            continue;
+        }
+
+        // Tail of this track where the crossfade actually starts, head of next track
+        float *tail = track->onsets + length + shiftHops + shift;
+        float mean = 0;
+        for (long t = 0; t < fadeHops; t++)
+        {
+            mean += tail[t];
+        }
+        mean /= fadeHops;
+        for (long k = 0; k < size; k++)
+        {
+            re[k] = k < fadeHops ? tail[k] - mean : 0;
+            im[k] = k < length ? next->onsets[k] : 0;
+        }
+        fft(re, im, size, twiddles);
+
+        // Unpack both spectra, cross spectrum conj(A) * B, conjugated for the inverse transform
+        for (long k = 0; k <= size / 2; k++)
+        {
+            long m = (size - k) & (size - 1);
+            float ar = (re[k] + re[m]) / 2;
+            float ai = (im[k] - im[m]) / 2;
+            float br = (im[k] + im[m]) / 2;
+            float bi = (re[m] - re[k]) / 2;
+            float cr = ar * br + ai * bi;
+            float ci = ar * bi - ai * br;
+            re[k] = cr;
+            im[k] = -ci;
+            re[m] = cr;
+            im[m] = ci;
+        }
+        fft(re, im, size, twiddles);
+
+        // re[shiftHops + lag] scores lag, keep the in-marker within the track, prefer small moves
+        long frames = next->data.ckSize / next->fmt.nBlockAlign;
+        long latest = frames - samplesPart > next->markerIn ? frames - samplesPart : next->markerIn;
+        long best = 0;
+        for (long lag = 1; lag <= shiftHops; lag++)
+        {
+            if (next->markerIn + lag * hop <= latest && re[shiftHops + lag] > re[shiftHops + best])
+            {
+                best = lag;
+            }
+            if (next->markerIn - lag * hop >= 0 && re[shiftHops - lag] > re[shiftHops + best])
+            {
+                best = -lag;
+            }
+        }
+
+        next->markerIn += best * hop;
+        next->shift = best * hop;
+        shift = best;
+        seekTrack(next);
+        printf("No %i - %s \033[0;32m(%+.0f ms)\033[0m\n", next->trackNumber, next->name, best * 1000.0 * hop / next->fmt.nSamplesPerSec);
+    }
+
+    for (Track *track = playlist; track != NULL; track = track->next)
+    {
+        free(track->onsets);
+        track->onsets = NULL;
+    }
+    free(re);
+    free(im);
+    free(twiddles);
+}
+
+
+// Features of the part of a track for similarity ordering (-o similar), single reading pass
+// for level, centroid and key (FFT of 4096 samples, Hann window), tempo from onset envelope
+void measureFeatures(Track *track)
+{
+    Features *features = &track->features;
+    int channels = track->fmt.nChannels;
+    long rate = track->fmt.nSamplesPerSec;
+    long size = 4096;
+    features->level = -INFINITY;
+    features->tempo = 0;
+    features->centroid = 0;
+    features->key = -1;
+
+    float *re = malloc(size * sizeof(float));
+    float *im = malloc(size * sizeof(float));
+    float *twiddles = makeTwiddles(size);
+    int16_t *buffer = malloc(size * track->fmt.nBlockAlign);
+    if (re == NULL || im == NULL || twiddles == NULL || buffer == NULL)
+    {
+        free(re);
+        free(im);
+        free(twiddles);
+        free(buffer);
+        return;
+    }
+
+    double square = 0;
+    double weighted = 0;
+    double power = 0;
+    double chroma[12] = {0};
+    long count = 0;
+
+    seekSample(track, track->markerIn);
+    for (long block = 0; block + size <= samplesPart; block += size)
+    {
+        if (readFrames(track, buffer, size) != size)
+        {
+            break;
+        }
+        for (long f = 0; f < size; f++)
+        {
+            float mono = channels == 2 ? (buffer[2 * f] + buffer[2 * f + 1]) * 0.5f : buffer[f];
+            square += mono * mono;
+            re[f] = mono * (0.5f - 0.5f * cosf(2 * M_PI * f / size));
+            im[f] = 0;
+        }
+        count += size;
+        fft(re, im, size, twiddles);
+
+        // Power spectrum: centroid over all bins, chroma from 65 Hz to 2 kHz (C = 0)
+        for (long k = 1; k < size / 2; k++)
+        {
+            double p = re[k] * re[k] + im[k] * im[k];
+            double hz = (double) k * rate / size;
+            weighted += hz * p;
+            power += p;
+            if (hz >= 65 && hz <= 2000)
+            {
+                long pitch = lround(12 * log2(hz / 261.63));
+                chroma[((pitch % 12) + 12) % 12] += p;
+            }
+        }
+    }
+    if (count > 0)
+    {
+        features->level = 10 * log10(square / count / (32768.0 * 32768.0));
+    }
+    if (power > 0)
+    {
+        features->centroid = weighted / power;
+
+        // Key: best correlation of chroma with rotated major and minor profiles (Krumhansl)
+        double major[12] = {6.35, 2.23, 3.48, 2.33, 4.38, 4.09, 2.52, 5.19, 2.39, 3.66, 2.29, 2.88};
+        double minor[12] = {6.33, 2.68, 3.52, 5.38, 2.60, 3.53, 2.54, 4.75, 3.98, 2.69, 3.34, 3.17};
+        double best = -INFINITY;
+        for (int key = 0; key < 24; key++)
+        {
+            double *profile = key < 12 ? major : minor;
+            double sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
+            for (int pc = 0; pc < 12; pc++)
+            {
+                double x = chroma[(pc + key) % 12];
+                double y = profile[pc];
+                sx += x;
+                sy += y;
+                sxx += x * x;
+                syy += y * y;
+                sxy += x * y;
+            }
+            double r = (12 * sxy - sx * sy) / sqrt((12 * sxx - sx * sx) * (12 * syy - sy * sy) + 1e-30);
+            if (r > best)
+            {
+                best = r;
+                features->key = key;
+            }
+        }
+    }
+
+    free(re);
+    free(im);
+    free(twiddles);
+    free(buffer);
+
+    // Tempo from onset envelope, moves file pointer back to in-marker
+    measureTempo(track);
+}
+
+
+// Tempo of the part of a track in BPM (similarity order, tempo matching), 0 if unknown
+// Strongest autocorrelation of its onset envelope between 60 and 180 BPM
+void measureTempo(Track *track)
+{
+    long rate = track->fmt.nSamplesPerSec;
+    long hop = rate / 200;
+    long hops = samplesPart / hop;
+    long slowest = 60 * rate / (60 * hop);
+    long fastest = 60 * rate / (180 * hop);
+    track->features.tempo = 0;
+
+    float *envelope = hops > 2 * slowest ? malloc(hops * sizeof(float)) : NULL;
+    if (envelope != NULL)
+    {
+        onsetEnvelope(track, track->markerIn, hops, envelope);
+
+        // Smear onsets over 5 hops, beat periods are no whole number of hops
+        float mean = 0;
+        float last[4] = {0};
+        for (long h = 0; h < hops; h++)
+        {
+            float smooth = (envelope[h] + 2 * last[0] + 3 * last[1] + 2 * last[2] + last[3]) / 9;
+            last[3] = last[2];
+            last[2] = last[1];
+            last[1] = last[0];
+            last[0] = envelope[h];
+            envelope[h] = smooth;
+            mean += smooth;
+        }
+        mean /= hops;
+        for (long h = 0; h < hops; h++)
+        {
+            envelope[h] -= mean;
+        }
+        double best = 0;
+        for (long lag = fastest; lag <= slowest; lag++)
+        {
+            double sum = 0;
+            for (long h = 0; h + lag < hops; h++)
+            {
+                sum += envelope[h] * envelope[h + lag];
+            }
+            sum /= hops - lag;
+            if (sum > best)
+            {
+                best = sum;
+                track->features.tempo = 60.0 * rate / (lag * hop);
+            }
+        }
+    }
+    free(envelope);
+
+    // Move file pointer back to in-marker
+    seekTrack(track);
+}
+
+
+// Transition distance of two tracks: level in 6 dB, tempo in 5 % (double or half time
+// counts as same tempo), centroid in half octaves, key in steps on the circle of fifths
+float trackDistance(Track *a, Track *b)
+{
+    Features *x = &a->features;
+    Features *y = &b->features;
+    float distance = 0;
+
+    if (isfinite(x->level) && isfinite(y->level))
+    {
+        distance += fabsf(x->level - y->level) / 6;
+    }
+    if (x->tempo > 0 && y->tempo > 0)
+    {
+        float octaves = fabsf(log2f(x->tempo / y->tempo));
+        distance += fminf(octaves, fabsf(octaves - 1)) / 0.07f;
+    }
+    if (x->centroid > 0 && y->centroid > 0)
+    {
+        distance += fabsf(log2f(x->centroid / y->centroid)) / 0.5f;
+    }
+    if (x->key >= 0 && y->key >= 0)
+    {
+        // Relative minor shares the position of its major key
+        int fifthsX = x->key < 12 ? x->key * 7 % 12 : (x->key + 3) * 7 % 12;
+        int fifthsY = y->key < 12 ? y->key * 7 % 12 : (y->key + 3) * 7 % 12;
+        int steps = abs(fifthsX - fifthsY);
+        distance += (steps < 12 - steps ? steps : 12 - steps) / 2.0f + ((x->key < 12) != (y->key < 12) ? 0.25f : 0);
+    }
+    return distance;
+}
+
+
+// Order playlist for smallest sum of transition distances, first track stays first
+// Greedy nearest neighbour path, improved by 2-opt (reversing a stretch of up to 64 tracks)
+// Returns new head of playlist, NULL if out of memory (playlist untouched)
+Track *orderTracks(Track *playlist)
+{
+    Track **order = malloc(trackCount * sizeof(Track *));
+    if (order == NULL)
+    {
+        return NULL;
+    }
+    long n = 0;
+    for (Track *track = playlist; track != NULL; track = track->next)
+    {
+        order[n++] = track;
+    }
+
+    // Greedy: always continue with the closest track left
+    for (long i = 1; i < n; i++)
+    {
+        long best = i;
+        float closest = INFINITY;
+        for (long j = i; j < n; j++)
+        {
+            float distance = trackDistance(order[i - 1], order[j]);
+            if (distance < closest)
+            {
+                closest = distance;
+                best = j;
+            }
+        }
+        Track *swap = order[i];
+        order[i] = order[best];
+        order[best] = swap;
+    }
+
+    // 2-opt: reverse order[i..j] if that shortens the path, short stretches and limited passes keep it linear
+    int improved = 1;
+    for (int pass = 0; pass < 20 && improved; pass++)
+    {
+        improved = 0;
+        for (long i = 1; i < n - 1; i++)
+        {
+            for (long j = i + 1; j < n && j < i + 64; j++)
+            {
+                float before = trackDistance(order[i - 1], order[i]);
+                float after = trackDistance(order[i - 1], order[j]);
+                if (j + 1 < n)
+                {
+                    before += trackDistance(order[j], order[j + 1]);
+                    after += trackDistance(order[i], order[j + 1]);
+                }
+                if (after < before - 1e-4f)
+                {
+                    for (long a = i, b = j; a < b; a++, b--)
+                    {
+                        Track *swap = order[a];
+                        order[a] = order[b];
+                        order[b] = swap;
+                    }
+                    improved = 1;
+                }
+            }
+        }
+    }
+
+    // Relink playlist in new order
+    for (long i = 0; i < n; i++)
+    {
+        order[i]->prev = i > 0 ? order[i - 1] : NULL;
+        order[i]->next = i + 1 < n ? order[i + 1] : NULL;
+    }
+    playlist = order[0];
+    free(order);
+    return playlist;
+}
+
+
+// Plan tempo-matched crossfades (--match-tempo): during the crossfade the outgoing track speeds up
+// (or slows down) from its own tempo to the tempo of the next one, the next track ramps from the
+// tempo of the outgoing track to its own. Transitions are rendered in parallel ahead of output.
+void matchTempos(Track *playlist)
+{
+    int channels = playlist->fmt.nChannels;
+    long count = samplesFade - 1;
+    long size = playlist->fmt.nSamplesPerSec / 25 & ~1L;
+    long pre = size;
+    long length = pre + (long) (1.25 * (count + size)) + size;
+
+    for (Track *track = playlist; track != NULL; track = track->next)
+    {
+        freeStretch(track);
+    }
+
+    // Samples of the track played in the crossfade into it, moves where its own crossfade starts
+    long headConsumed = 0;
+    for (Track *track = playlist; track != NULL && track->next != NULL; track = track->next)
+    {
+        Track *next = track->next;
+        long tailStart = headConsumed + samplesPart - samplesFade + 1 - (track->prev != NULL ? samplesFade : 0);
+        headConsumed = count;
+
+        // Half or double time counts as same tempo, never stretch by more than 25 %
+        float from = track->features.tempo;
+        float to = next->features.tempo;
+        if (from <= 0 || to <= 0)
+        {
+            printf("No %i - %s \033[0;33m(tempo unknown, plain crossfade)\033[0m\n", next->trackNumber, next->name);
+            continue;
+        }
+        float ratio = to / from;
+        while (ratio > M_SQRT2)
+        {
+            ratio /= 2;
+        }
+        while (ratio < M_SQRT1_2)
+        {
+            ratio *= 2;
+        }
+        if (fabsf(ratio - 1) < 0.01 || count < 2 * size)
+        {
+            printf("No %i - %s \033[0;32m(%.0f BPM, plain crossfade)\033[0m\n", next->trackNumber, next->name, to);
+            continue;
+        }
+        ratio = ratio > 1.25 ? 1.25 : ratio < 0.8 ? 0.8 : ratio;
+
+        Stretch *stretch = malloc(sizeof(Stretch));
+        if (stretch == NULL)
+        {
+            continue;
+        }
+        stretch->ratio = ratio;
+        stretch->tailStart = tailStart;
+        stretch->consumed = lround(count / ratio * (ratio - 1) / log(ratio));
+        stretch->length = length;
+        stretch->pre = pre;
+        stretch->tail = malloc(length * channels * sizeof(float));
+        stretch->head = malloc(length * channels * sizeof(float));
+        stretch->frames = malloc(count * channels * sizeof(int16_t));
+        track->stretch = stretch;
+        if (stretch->tail == NULL || stretch->head == NULL || stretch->frames == NULL)
+        {
+            freeStretch(track);
+            continue;
+        }
+        headConsumed = stretch->consumed;
+
+        printf("No %i - %s \033[0;32m(%.0f → %.0f BPM, %+.1f %%)\033[0m\n", next->trackNumber, next->name, from, to, (ratio - 1) * 100);
+    }
+
+    // Every track reads its own edges, then every transition is stretched and mixed on its own
+    processTracks(playlist, readEdges, 0);
+    processTracks(playlist, stretchCrossfade, 0);
+}
+
+
+// Read audio around tempo-matched crossfades: tail of the track into its stretch, head of the track
+// into the stretch of the track before
+void readEdges(Track *track)
+{
+    if (track->stretch != NULL)
+    {
+        readPlanar(track, track->markerIn + track->stretch->tailStart - track->stretch->pre, track->stretch->length, track->stretch->tail);
+    }
+    if (track->prev != NULL && track->prev->stretch != NULL)
+    {
+        readPlanar(track, track->markerIn - track->prev->stretch->pre, track->prev->stretch->length, track->prev->stretch->head);
+    }
+
+    // Move file pointer back to in-marker
+    seekTrack(track);
+}
+
+
+// Read count frames from sample start on as float, channel after channel
+// Samples before the start or after the end of the track are silent
+void readPlanar(Track *track, long start, long count, float *planar)
+{
+    int channels = track->fmt.nChannels;
+    long frames = track->data.ckSize / track->fmt.nBlockAlign;
+    int16_t buffer[4096 * channels];
+
+    memset(planar, 0, count * channels * sizeof(float));
+    long done = start < 0 ? -start : 0;
+    long end = frames - start < count ? frames - start : count;
+    if (done < end)
+    {
+        seekSample(track, start + done);
+    }
+    while (done < end)
+    {
+        long n = end - done < 4096 ? end - done : 4096;
+        long read = readFrames(track, buffer, n);
+        for (long f = 0; f < read; f++)
+        {
+            for (int c = 0; c < channels; c++)
+            {
+                planar[c * count + done + f] = buffer[f * channels + c];
+            }
+        }
+        if (read < n)
+        {
+            break;
+        }
+        done += n;
+    }
+}
+
+
+// Render the tempo-matched crossfade of a track into the next one: both sides stretched,
+// faded and mixed the same way renderFrame does it
+void stretchCrossfade(Track *track)
+{
+    Stretch *stretch = track->stretch;
+    if (stretch == NULL)
+    {
+        return;
+    }
+    Track *next = track->next;
+    int channels = track->fmt.nChannels;
+    long count = samplesFade - 1;
+    long size = track->fmt.nSamplesPerSec / 25 & ~1L;
+
+    // Periodic Hann window, at 50 % overlap the windows add up to one
+    float *window = malloc(size * sizeof(float));
+    float *outgoing = malloc(count * channels * sizeof(float));
+    float *incoming = malloc(count * channels * sizeof(float));
+    if (window == NULL || outgoing == NULL || incoming == NULL ||
+        !stretchSource(stretch->tail, stretch->length, stretch->pre, channels, stretch->ratio, 1, window, size, outgoing, count) ||
+        !stretchSource(stretch->head, stretch->length, stretch->pre, channels, stretch->ratio, 1 / stretch->ratio, window, size, incoming, count))
+    {
+        // Plain crossfade instead
+        free(window);
+        free(outgoing);
+        free(incoming);
+        freeStretch(track);
+        return;
+    }
+
+    for (long n = 0; n < count; n++)
+    {
+        float x = (float) (n + 1) / samplesFade;
+        for (int c = 0; c < channels; c++)
+        {
+            int16_t fadeOut = clip16(outgoing[c * count + n] * track->gain * sqrt(1 - x));
+            int16_t fadeIn = clip16(incoming[c * count + n] * next->gain * sqrt(x));
+            stretch->frames[n * channels + c] = clip16(fadeOut + fadeIn);
+        }
+    }
+
+    free(window);
+    free(outgoing);
+    free(incoming);
+    free(stretch->tail);
+    free(stretch->head);
+    stretch->tail = NULL;
+    stretch->head = NULL;
+}
+
+
+// Time-stretch one side of a crossfade (WSOLA) into count frames, channel after channel
+// Output sample n plays source position scale * count / ln(ratio) * (ratio^(n / count) - 1),
+// so the playback rate ramps from scale to scale * ratio. Hann frames with 50 % overlap are each
+// moved up to a quarter frame to continue the waveform of the frame before (coarse search on a
+// mono signal decimated by 4, then refined), first and last frames are not moved to join the
+// audio around the crossfade. Source position 0 is at pre within the length of source.
+// Returns 0 if memory is short
+int stretchSource(float *source, long length, long pre, int channels, float ratio, float scale, float *window, long size,
+                  float *out, long count)
+{
+    long hop = size / 2;
+    long delta = size / 4;
+    double logRatio = log(ratio);
+
+    float *mono = malloc(length * sizeof(float));
+    float *coarse = malloc((length / 4 + 1) * sizeof(float));
+    if (mono == NULL || coarse == NULL)
+    {
+        free(mono);
+        free(coarse);
+        return 0;
+    }
+    for (long i = 0; i < size; i++)
+    {
+        window[i] = 0.5 - 0.5 * cos(2 * M_PI * i / size);
+    }
+    for (long i = 0; i < length; i++)
+    {
+        mono[i] = 0;
+        for (int c = 0; c < channels; c++)
+        {
+            mono[i] += source[c * length + i];
+        }
+    }
+    for (long i = 0; i < length / 4; i++)
+    {
+        coarse[i] = mono[4 * i] + mono[4 * i + 1] + mono[4 * i + 2] + mono[4 * i + 3];
+    }
+    memset(out, 0, count * channels * sizeof(float));
+
+    long previous = 0;
+    for (long k = -1; k * hop < count; k++)
+    {
+        // Source start of frame if centres of frame and source meet
+        long at = k * hop;
+        double position = scale * count / logRatio * (exp(logRatio * (at + hop) / count) - 1);
+        long start = pre + lround(position) - hop;
+        start = start < 0 ? 0 : start > length - size ? length - size : start;
+
+        // Best match with the natural continuation of the frame before
+        long target = previous + hop;
+        if (k > -1 && at + size < count && target + size <= length)
+        {
+            long lowest = start - delta < 0 ? 0 : start - delta;
+            long highest = start + delta > length - size ? length - size : start + delta;
+            long best = start;
+            float score = -INFINITY;
+            for (long candidate = lowest; candidate <= highest; candidate += 4)
+            {
+                float s = similarity(coarse + target / 4, coarse + candidate / 4, size / 4);
+                if (s > score)
+                {
+                    score = s;
+                    best = candidate;
+                }
+            }
+            long centre = best;
+            score = -INFINITY;
+            for (long candidate = centre - 3; candidate <= centre + 3; candidate++)
+            {
+                if (candidate < lowest || candidate > highest)
+                {
+                    continue;
+                }
+                float s = similarity(mono + target, mono + candidate, size);
+                if (s > score)
+                {
+                    score = s;
+                    best = candidate;
+                }
+            }
+            start = best;
+        }
+        previous = start;
+
+        // Overlap-add, part of frame within output only
+        long first = at < 0 ? -at : 0;
+        long last = at + size > count ? count - at : size;
+        for (int c = 0; c < channels; c++)
+        {
+            float *restrict y = out + c * count;
+            float *restrict x = source + c * length + start;
+            for (long i = first; i < last; i++)
+            {
+                y[at + i] += window[i] * x[i];
+            }
+        }
+    }
+
+    free(mono);
+    free(coarse);
+    return 1;
+}
+
+
+// Normalized cross-correlation of b with a (energy of a is the same for every b)
+float similarity(float *a, float *b, long n)
+{
+    float product = 0;
+    float energy = 0;
+    for (long i = 0; i < n; i++)
+    {
+        product += a[i] * b[i];
+        energy += b[i] * b[i];
+    }
+    return product / sqrtf(energy + 1);
+}
+
+
+// Free tempo-matched crossfade of a track, if there is one
+void freeStretch(Track *track)
+{
+    if (track->stretch == NULL)
+    {
+        return;
+    }
+    free(track->stretch->tail);
+    free(track->stretch->head);
+    free(track->stretch->frames);
+    free(track->stretch);
+    track->stretch = NULL;
+}
+
+
+// Key of the part of a track in the medley: source file identity, in-marker and gain
+uint64_t trackKey(Track *track)
+{
+    struct stat info;
+    fstat(fileno(track->audiofile), &info);
+    long identity[] = {info.st_dev, info.st_ino, info.st_size, info.st_mtim.tv_sec, info.st_mtim.tv_nsec, track->markerIn};
+    uint64_t hash = hashBytes(0xcbf29ce484222325, identity, sizeof(identity));
+    return hashBytes(hash, &track->gain, sizeof(float));
+}
+
+
+// Wait for changes in watched directory, collect names of changed files until it is quiet for a second
+// Returns number of names, names and array are malloc'ed
+int waitChanges(int notify, char ***names)
+{
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd wait = {notify, POLLIN, 0};
+    int count = 0;
+    *names = NULL;
+
+    // Block for first event, then take events as long as they keep coming
+    int timeout = -1;
+    while (poll(&wait, 1, timeout) > 0)
+    {
+        timeout = 1000;
+        ssize_t length = read(notify, buffer, sizeof(buffer));
+        for (char *at = buffer; length > 0 && at < buffer + length; at += sizeof(struct inotify_event) + ((struct inotify_event *) at)->len)
+        {
+            struct inotify_event *event = (struct inotify_event *) at;
+            if (event->len == 0)
+            {
+                continue;
+            }
+            int known = 0;
+            for (int n = 0; n < count && !known; n++)
+            {
+                known = !strcmp((*names)[n], event->name);
+            }
+            char **more = known ? NULL : realloc(*names, (count + 1) * sizeof(char *));
+            if (more != NULL)
+            {
+                *names = more;
+                (*names)[count] = strdup(event->name);
+                count += (*names)[count] != NULL;
+            }
+        }
+    }
+    return count;
+}
+
+
+// DEBUG: Print order of playlist
+void printTracks(Track *playlist)
+{
+    printf("\n\nORDER 1:\n");
+    Track *temp = playlist;
+    while (temp != NULL)
+    {
+        if (temp->name != NULL)
+        {
+            printf("No %i: %s | prev: %s | next: %s\n", temp->trackNumber, temp->name, temp->prev == NULL ? "NULL" : temp->prev->name,
+                   temp->next == NULL ? "NULL" : temp->next->name);
+        }
+        else
+        {
+            printf("No Name\n");
+        }
+        temp = temp->next;
+    }
+    printf("\n\n");
+}
+
+
+
+// ----------------------------------------------------------
+// F L A C   D E C O D E R
+// Probe STREAMINFO, seek via SEEKTABLE or frame headers and
+// decode only the frames that are actually needed
+// ----------------------------------------------------------
+
+
+// Read big endian number of n bytes
+uint64_t readBigEndian(BYTE *bytes, int n)
+{
+    uint64_t value = 0;
+    for (int b = 0; b < n; b++)
+    {
+        value = (value << 8) | bytes[b];
+    }
+    return value;
+}
+
+
+// Probe FLAC track: walk metadata block headers, read STREAMINFO only, remember SEEKTABLE position
+// Returns 0 on success
+int readStreamInfo(Track *track)
+{
+    BYTE header[4];
+    BYTE streamInfo[34];
+    int found = 0;
+    FlacStream *flac = calloc(1, sizeof(FlacStream));
+    if (flac == NULL)
+    {
+        return 2;
+    }
+    track->flac = flac;
+
+    fseek(track->audiofile, 4, SEEK_SET);
+    do
+    {
+        if (fread(header, sizeof(header), 1, track->audiofile) != 1)
+        {
+            return 4;
+        }
+        int type = header[0] & 0x7F;
+        long length = readBigEndian(header + 1, 3);
+
+        // STREAMINFO: block sizes, sample rate, channels, bit depth, total samples
+        if (type == 0 && length == sizeof(streamInfo))
+        {
+            if (fread(streamInfo, sizeof(streamInfo), 1, track->audiofile) != 1)
+            {
+                return 4;
+            }
+            uint64_t packed = readBigEndian(streamInfo + 10, 8);
+            flac->minBlock = readBigEndian(streamInfo, 2);
+            flac->maxBlock = readBigEndian(streamInfo + 2, 2);
+            track->fmt.nSamplesPerSec = packed >> 44;
+            track->fmt.nChannels = ((packed >> 41) & 0x7) + 1;
+            track->fmt.wBitsPerSample = ((packed >> 36) & 0x1F) + 1;
+            flac->totalSamples = packed & 0xFFFFFFFFF;
+            found = 1;
+            continue;
+        }
+
+        // SEEKTABLE: 18 bytes per seek point, read on first seek
+        if (type == 3)
+        {
+            flac->seekTable = ftell(track->audiofile);
+            flac->seekCount = length / 18;
+        }
+        fseek(track->audiofile, length, SEEK_CUR);
+    }
+    while (!(header[0] & 0x80));
+
+    if (!found || flac->maxBlock < 16 || flac->maxBlock < flac->minBlock || flac->totalSamples == 0)
+    {
+        return 4;
+    }
+
+    struct stat info;
+    flac->fd = fileno(track->audiofile);
+    flac->channels = track->fmt.nChannels;
+    flac->firstFrame = ftell(track->audiofile);
+    flac->fileSize = fstat(flac->fd, &info) == 0 ? info.st_size : 0;
+    flac->target = -1;
+    flac->offset = flac->firstFrame;
+
+    // Present FLAC like a 16 bit PCM wave file to the rest of medley
+    track->fmt.ckID = FMT;
+    track->fmt.ckSize = 16;
+    track->fmt.wFormatTag = 1;
+    track->fmt.nBlockAlign = track->fmt.nChannels * track->fmt.wBitsPerSample / 8;
+    track->fmt.nAvgBytesPerSec = track->fmt.nSamplesPerSec * track->fmt.nBlockAlign;
+    track->data.ckID = DATA;
+    track->data.ckSize = flac->totalSamples * track->fmt.nBlockAlign;
+    track->dataOffset = flac->firstFrame;
+
+    flac->block = malloc(flac->maxBlock * track->fmt.nChannels * sizeof(int16_t));
+    flac->work = malloc(flac->maxBlock * track->fmt.nChannels * sizeof(int32_t));
+    if (flac->block == NULL || flac->work == NULL)
+    {
+        return 2;
+    }
+    return 0;
+}
+
+
+// Free FLAC decoder of a track
+void freeFlac(FlacStream *flac)
+{
+    if (flac == NULL)
+    {
+        return;
+    }
+    free(flac->points);
+    free(flac->block);
+    free(flac->work);
+    free(flac);
+}
+
+
+// Move FLAC reader to byte offset in file
+void flacReposition(FlacStream *flac, long offset)
+{
+    flac->offset = offset;
+    flac->length = 0;
+    flac->pos = 0;
+    flac->bitCount = 0;
+}
+
+
+// Next byte of FLAC stream, refills buffer, 0 past end of file
+int flacByte(FlacStream *flac)
+{
+    if (flac->pos == flac->length)
+    {
+        flac->offset += flac->length;
+        flac->pos = 0;
+        flac->length = pread(flac->fd, flac->buffer, sizeof(flac->buffer), flac->offset);
+        if (flac->length <= 0)
+        {
+            flac->length = 0;
+            return 0;
+        }
+    }
+    return flac->buffer[flac->pos++];
+}
+
+
+// Read n bits (up to 32) from FLAC stream
+uint32_t readBits(FlacStream *flac, int n)
+{
+    while (flac->bitCount < n)
+    {
+        flac->bitCache = (flac->bitCache << 8) | flacByte(flac);
+        flac->bitCount += 8;
+    }
+    flac->bitCount -= n;
+    return (flac->bitCache >> flac->bitCount) & (((uint64_t) 1 << n) - 1);
+}
+
+
+// Read n bits as two's complement signed number
+int32_t readSigned(FlacStream *flac, int n)
+{
+    if (n == 0)
+    {
+        return 0;
+    }
+    return (int32_t)(readBits(flac, n) << (32 - n)) >> (32 - n);
+}
+
+
+// Read unary coded number: count of 0 bits before next 1 bit
+uint32_t readUnary(FlacStream *flac)
+{
+    uint32_t zeros = 0;
+    while (1)
+    {
+        if (flac->bitCount == 0)
+        {
+            flac->bitCache = flacByte(flac);
+            flac->bitCount = 8;
+            if (flac->length == 0)
+            {
+                return zeros;
+            }
+        }
+        uint64_t bits = flac->bitCache & (((uint64_t) 1 << flac->bitCount) - 1);
+        if (bits == 0)
+        {
+            zeros += flac->bitCount;
+            flac->bitCount = 0;
+            continue;
+        }
+        int top = 63 - __builtin_clzll(bits);
+        zeros += flac->bitCount - 1 - top;
+        flac->bitCount = top;
+        return zeros;
+    }
+}
+
+
+// Parse and validate (sync code, CRC-8) a frame header from bytes
+// Returns 1 if bytes start with a valid frame header
+int parseFrameHeader(FlacStream *flac, BYTE *bytes, int length, FrameHeader *header)
+{
+    if (length < 6 || bytes[0] != 0xFF || (bytes[1] & 0xFE) != 0xF8)
+    {
+        return 0;
+    }
+    int variable = bytes[1] & 1;
+    int blockCode = bytes[2] >> 4;
+    int rateCode = bytes[2] & 0xF;
+    int sizeCode = (bytes[3] >> 1) & 0x7;
+    header->channelMode = bytes[3] >> 4;
+    if (blockCode == 0 || rateCode == 15 || header->channelMode > 10 || sizeCode == 3 || sizeCode == 7 || (bytes[3] & 1))
+    {
+        return 0;
+    }
+
+    // Frame or sample number, UTF-8 like coding
+    int p = 4;
+    uint64_t number = bytes[p++];
+    int extra = 0;
+    while (extra < 7 && (number & (0x80 >> extra)))
+    {
+        extra++;
+    }
+    if (extra == 1 || extra == 7)
+    {
+        return 0;
+    }
+    extra = extra ? extra - 1 : 0;
+    number &= 0x7F >> extra;
+    for (int e = 0; e < extra; e++)
+    {
+        if (p >= length || (bytes[p] & 0xC0) != 0x80)
+        {
+            return 0;
+        }
+        number = (number << 6) | (bytes[p++] & 0x3F);
+    }
+
+    // Block size
+    if (blockCode == 1)
+    {
+        header->blockSize = 192;
+    }
+    else if (blockCode <= 5)
+    {
+        header->blockSize = 576 << (blockCode - 2);
+    }
+    else if (blockCode == 6)
+    {
+        header->blockSize = (p < length ? bytes[p] : 0) + 1;
+        p += 1;
+    }
+    else if (blockCode == 7)
+    {
+        header->blockSize = (p + 1 < length ? readBigEndian(bytes + p, 2) : 0) + 1;
+        p += 2;
+    }
+    else
+    {
+        header->blockSize = 256 << (blockCode - 8);
+    }
+
+    // Sample rate stored at end of header
+    p += rateCode == 12 ? 1 : rateCode == 13 || rateCode == 14 ? 2 : 0;
+    if (p >= length)
+    {
+        return 0;
+    }
+
+    // CRC-8, polynomial x^8 + x^2 + x + 1
+    BYTE crc = 0;
+    for (int b = 0; b < p; b++)
+    {
+        crc ^= bytes[b];
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+    if (crc != bytes[p] || header->blockSize > flac->maxBlock)
+    {
+        return 0;
+    }
+
+    header->firstSample = variable ? (long) number : (long) number * flac->minBlock;
+    header->length = p + 1;
+    return 1;
+}
+
+
+// Decode residual of a subframe (partitioned Rice coding) into out, after warm-up samples
+int decodeResidual(FlacStream *flac, int32_t *out, long blockSize, int order)
+{
+    int method = readBits(flac, 2);
+    if (method > 1)
+    {
+        return 0;
+    }
+    int paramBits = method ? 5 : 4;
+    uint32_t escape = method ? 31 : 15;
+    int partitionOrder = readBits(flac, 4);
+    long n = order;
+
+    for (long partition = 0; partition < (1 << partitionOrder); partition++)
+    {
+        long count = (blockSize >> partitionOrder) - (partition == 0 ? order : 0);
+        if (count < 0 || n + count > blockSize)
+        {
+            return 0;
+        }
+        uint32_t param = readBits(flac, paramBits);
+        if (param == escape)
+        {
+            int raw = readBits(flac, 5);
+            for (long i = 0; i < count; i++)
+            {
+                out[n++] = readSigned(flac, raw);
+            }
+            continue;
+        }
+        for (long i = 0; i < count; i++)
+        {
+            uint32_t u = (readUnary(flac) << param) | readBits(flac, param);
+            out[n++] = (u >> 1) ^ -(u & 1);
+        }
+    }
+    return 1;
+}
+
+
+// Decode one subframe (channel) of bps bits into out
+int decodeSubframe(FlacStream *flac, int32_t *out, long blockSize, int bps)
+{
+    readBits(flac, 1);
+    int type = readBits(flac, 6);
+    int wasted = 0;
+    if (readBits(flac, 1))
+    {
+        wasted = readUnary(flac) + 1;
+        bps -= wasted;
+    }
+
+    // CONSTANT
+    if (type == 0)
+    {
+        int32_t value = readSigned(flac, bps);
+        for (long i = 0; i < blockSize; i++)
+        {
+            out[i] = value;
+        }
+    }
+    // VERBATIM
+    else if (type == 1)
+    {
+        for (long i = 0; i < blockSize; i++)
+        {
+            out[i] = readSigned(flac, bps);
+        }
+    }
+    // FIXED predictor, order 0 to 4
+    else if (type >= 8 && type <= 12)
+    {
+        int order = type - 8;
+        if (order > blockSize)
+        {
+            return 0;
+        }
+        for (int i = 0; i < order; i++)
+        {
+            out[i] = readSigned(flac, bps);
+        }
+        if (!decodeResidual(flac, out, blockSize, order))
+        {
+            return 0;
+        }
+        for (long i = order; i < blockSize; i++)
+        {
+            switch (order)
+            {
+                case 1:
+                    out[i] += out[i - 1];
+                    break;
+                case 2:
+                    out[i] += 2 * out[i - 1] - out[i - 2];
+                    break;
+                case 3:
+                    out[i] += 3 * out[i - 1] - 3 * out[i - 2] + out[i - 3];
+                    break;
+                case 4:
+                    out[i] += 4 * out[i - 1] - 6 * out[i - 2] + 4 * out[i - 3] - out[i - 4];
+                    break;
+            }
+        }
+    }
+    // LPC, order 1 to 32
+    else if (type >= 32)
+    {
+        int order = (type & 31) + 1;
+        if (order > blockSize)
+        {
+            return 0;
+        }
+        for (int i = 0; i < order; i++)
+        {
+            out[i] = readSigned(flac, bps);
+        }
+        int precision = readBits(flac, 4) + 1;
+        int shift = readSigned(flac, 5);
+        if (precision == 16 || shift < 0)
+        {
+            return 0;
+        }
+        int32_t coefs[32];
+        for (int c = 0; c < order; c++)
+        {
+            coefs[c] = readSigned(flac, precision);
+        }
+        if (!decodeResidual(flac, out, blockSize, order))
+        {
+            return 0;
+        }
+        for (long i = order; i < blockSize; i++)
+        {
+            int64_t sum = 0;
+            for (int c = 0; c < order; c++)
+            {
+                sum += (int64_t) coefs[c] * out[i - 1 - c];
+            }
+            out[i] += sum >> shift;
+        }
+    }
+    else
+    {
+        return 0;
+    }
+
+    if (wasted)
+    {
+        for (long i = 0; i < blockSize; i++)
+        {
+            out[i] <<= wasted;
+        }
+    }
+    return 1;
+}
+
+
+// Decode next frame into block, returns 0 at end of stream or on corrupt frame (incl. CRC-16 mismatch)
+int decodeFrame(FlacStream *flac)
+{
+    // Frame starts byte aligned: make sure the whole frame (at most about 4 bytes per sample,
+    // up to half the buffer) is in buffer, so its CRC-16 can be checked in place
+    long room = 18 + flac->channels * (flac->maxBlock * 4 + 8);
+    room = room < (long) sizeof(flac->buffer) / 2 ? room : (long) sizeof(flac->buffer) / 2;
+    flac->bitCount = 0;
+    if (flac->length - flac->pos < room)
+    {
+        memmove(flac->buffer, flac->buffer + flac->pos, flac->length - flac->pos);
+        flac->offset += flac->pos;
+        flac->length -= flac->pos;
+        flac->pos = 0;
+        ssize_t n = pread(flac->fd, flac->buffer + flac->length, sizeof(flac->buffer) - flac->length, flac->offset + flac->length);
+        flac->length += n > 0 ? n : 0;
+    }
+
+    FrameHeader header;
+    long start = flac->offset + flac->pos;
+    if (!parseFrameHeader(flac, flac->buffer + flac->pos, flac->length - flac->pos, &header))
+    {
+        return 0;
+    }
+    flac->pos += header.length;
+
+    int channels = header.channelMode < 8 ? header.channelMode + 1 : 2;
+    int stereo = channels == 2;
+    if (channels != flac->channels)
+    {
+        return 0;
+    }
+    long size = header.blockSize;
+    int32_t *left = flac->work;
+    int32_t *right = flac->work + flac->maxBlock;
+
+    for (int c = 0; c < channels; c++)
+    {
+        // Side channel carries one extra bit
+        int side = (header.channelMode == 8 && c == 1) || (header.channelMode == 9 && c == 0) || (header.channelMode == 10 && c == 1);
+        if (!decodeSubframe(flac, c ? right : left, size, 16 + side))
+        {
+            return 0;
+        }
+    }
+
+    // Undo inter-channel decorrelation
+    for (long i = 0; stereo && i < size; i++)
+    {
+        if (header.channelMode == 8)
+        {
+            right[i] = left[i] - right[i];
+        }
+        else if (header.channelMode == 9)
+        {
+            left[i] += right[i];
+        }
+        else if (header.channelMode == 10)
+        {
+            int32_t mid = ((uint32_t) left[i] << 1) | (right[i] & 1);
+            left[i] = (mid + right[i]) >> 1;
+            right[i] = (mid - right[i]) >> 1;
+        }
+    }
+
+    // Interleave
+    for (long i = 0; i < size; i++)
+    {
+        flac->block[i * channels] = left[i];
+        if (stereo)
+        {
+            flac->block[i * 2 + 1] = right[i];
+        }
+    }
+
+    // Footer: byte align, CRC-16 over whole frame (read again if it did not fit in buffer)
+    flac->bitCount -= flac->bitCount % 8;
+    long end = flac->offset + flac->pos;
+    WORD crc = readBits(flac, 16);
+    if (start >= flac->offset)
+    {
+        if (crc16(flac->buffer + start - flac->offset, end - start) != crc)
+        {
+            return 0;
+        }
+    }
+    else
+    {
+        BYTE *frame = malloc(end - start);
+        int valid = frame != NULL && pread(flac->fd, frame, end - start, start) == end - start && crc16(frame, end - start) == crc;
+        free(frame);
+        if (!valid)
+        {
+            return 0;
+        }
+    }
+    flac->blockStart = header.firstSample;
+    flac->blockFrames = size;
+    flac->blockPos = 0;
+    return 1;
+}
+
+
+// Next block of samples: decoded frame, or silence standing in for frames lost to corruption,
+// a corrupt frame is skipped by searching the next valid frame. Returns 0 at end of stream
+int nextBlock(FlacStream *flac)
+{
+    long expected = flac->blockStart + flac->blockFrames;
+    while (1)
+    {
+        if (expected < flac->lostUntil)
+        {
+            long n = flac->lostUntil - expected < flac->maxBlock ? flac->lostUntil - expected : flac->maxBlock;
+            memset(flac->block, 0, n * flac->channels * sizeof(int16_t));
+            flac->blockStart = expected;
+            flac->blockFrames = n;
+            flac->blockPos = 0;
+            return 1;
+        }
+
+        long start = flac->offset + flac->pos;
+        if (decodeFrame(flac))
+        {
+            return 1;
+        }
+
+        // Resync: first frame after the corrupt one that continues the stream
+        long at = start;
+        FrameHeader header;
+        do
+        {
+            if (!nextFrameHeader(flac, at + 1, flac->fileSize, &at, &header))
+            {
+                return 0;
+            }
+        }
+        while (header.firstSample < expected);
+        flacReposition(flac, at);
+        flac->lostUntil = header.firstSample;
+        flac->blockStart = expected;
+        flac->blockFrames = 0;
+    }
+}
+
+
+// Find next valid frame at or after byte offset from, before byte offset to: sync code and CRC-8
+// of its header are not enough on arbitrary audio bytes, the frame has to decode and pass its CRC-16
+// Returns 1 and sets at (byte offset) and header if found, the frame is decoded into block
+int nextFrameHeader(FlacStream *flac, long from, long to, long *at, FrameHeader *header)
+{
+    BYTE bytes[4096 + 16];
+    while (from < to)
+    {
+        ssize_t n = pread(flac->fd, bytes, sizeof(bytes), from);
+        if (n <= 0)
+        {
+            return 0;
+        }
+        long scan = n > 4096 ? 4096 : n;
+        for (long b = 0; b < scan && from + b < to; b++)
+        {
+            if (bytes[b] == 0xFF && parseFrameHeader(flac, bytes + b, n - b, header))
+            {
+                flacReposition(flac, from + b);
+                if (decodeFrame(flac))
+                {
+                    *at = from + b;
+                    return 1;
+                }
+            }
+        }
+        from += scan;
+    }
+    return 0;
+}
+
+
+// Seek FLAC stream to sample: closest seek point, then bisection over frame headers,
+// then decode frames until the one holding the sample
+void flacSeek(FlacStream *flac, long target)
+{
+    // Within (or right after) the decoded block: no seek needed
+    if (flac->blockFrames > 0 && target >= flac->blockStart && target <= flac->blockStart + flac->blockFrames)
+    {
+        flac->blockPos = target - flac->blockStart;
+        return;
+    }
+
+    // Seek table, read on first seek
+    if (flac->seekCount > 0 && flac->points == NULL)
+    {
+        BYTE *table = malloc(flac->seekCount * 18);
+        flac->points = malloc(flac->seekCount * sizeof(SeekPoint));
+        if (table == NULL || flac->points == NULL || pread(flac->fd, table, flac->seekCount * 18, flac->seekTable) != flac->seekCount * 18)
+        {
+            flac->seekCount = 0;
+        }
+        for (long i = 0; i < flac->seekCount; i++)
+        {
+            flac->points[i].sample = readBigEndian(table + i * 18, 8);
+            flac->points[i].offset = readBigEndian(table + i * 18 + 8, 8);
+        }
+        free(table);
+    }
+
+    // Closest seek point before target, placeholders have sample 0xFFFFFFFFFFFFFFFF
+    long low = flac->firstFrame;
+    long sample = 0;
+    for (long i = 0; i < flac->seekCount; i++)
+    {
+        if (flac->points[i].sample <= (uint64_t) target && (long) flac->points[i].sample >= sample)
+        {
+            sample = flac->points[i].sample;
+            low = flac->firstFrame + flac->points[i].offset;
+        }
+    }
+
+    // Still far away: bisection over frame headers, decoding only the frame found at each probe
+    long high = flac->fileSize;
+    while (target - sample > 4 * flac->maxBlock && high - low > 65536)
+    {
+        long mid = low + (high - low) / 2;
+        long at;
+        FrameHeader header;
+        if (nextFrameHeader(flac, mid, high, &at, &header) && header.firstSample <= target && header.firstSample > sample)
+        {
+            low = at;
+            sample = header.firstSample;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    // Decode up to the frame holding target
+    flacReposition(flac, low);
+    flac->blockStart = sample;
+    flac->blockFrames = 0;
+    flac->lostUntil = sample;
+    while (nextBlock(flac))
+    {
+        if (target < flac->blockStart + flac->blockFrames)
+        {
+            flac->blockPos = target > flac->blockStart ? target - flac->blockStart : 0;
+            return;
+        }
+    }
+    flac->blockPos = flac->blockFrames;
+}
+
+
+
+// ----------------------------------------------------------
+// D I R E C T   O U T P U T
+// Wave output in large aligned blocks with O_DIRECT, so the
+// medley does not fill the page cache (--direct)
+// ----------------------------------------------------------
+
+
+// Open output for direct writing, falls back to buffered writing if O_DIRECT is not supported
+// Returns 0 on success, 2 if out of memory, 5 if file can't be opened
+int startDirect(Track *output)
+{
+    DirectWriter *writer = calloc(1, sizeof(DirectWriter));
+    if (writer == NULL)
+    {
+        return 2;
+    }
+    if (posix_memalign((void **) &writer->buffer, DIRECT_ALIGN, DIRECT_BUFFER) != 0)
+    {
+        free(writer);
+        return 2;
+    }
+
+    writer->direct = 1;
+    writer->fd = open(output->name, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+    if (writer->fd < 0 && errno == EINVAL)
+    {
+        printf("O_DIRECT not supported for %s, writing thru page cache\n", output->name);
+        writer->direct = 0;
+        writer->fd = open(output->name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    if (writer->fd < 0)
+    {
+        free(writer->buffer);
+        free(writer);
+        return 5;
+    }
+    output->direct = writer;
+    return 0;
+}
+
+
+// Write bytes of buffer at its aligned file offset
+// Returns 0 on success or errno of the failed write, after an error nothing is written anymore
+int flushDirect(DirectWriter *writer, long bytes)
+{
+    long done = 0;
+    while (writer->error == 0 && done < bytes)
+    {
+        ssize_t n = pwrite(writer->fd, writer->buffer + done, bytes - done, writer->offset + done);
+        if (n > 0)
+        {
+            done += n;
+        }
+        // O_DIRECT accepted on open but not for writing: go on thru page cache
+        else if (n < 0 && errno == EINVAL && writer->direct)
+        {
+            printf("\nO_DIRECT writes not supported, writing thru page cache\n ");
+            fcntl(writer->fd, F_SETFL, fcntl(writer->fd, F_GETFL) & ~O_DIRECT);
+            writer->direct = 0;
+        }
+        else if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else
+        {
+            writer->error = n < 0 ? errno : EIO;
+        }
+    }
+    writer->offset += bytes;
+    return writer->error;
+}
+
+
+// Append bytes to output, header and audio go thru the same aligned buffer
+void writeBytes(Track *output, void *data, long bytes)
+{
+    DirectWriter *writer = output->direct;
+    if (writer == NULL)
+    {
+        fwrite(data, bytes, 1, output->audiofile);
+        return;
+    }
+
+    BYTE *from = data;
+    while (bytes > 0)
+    {
+        long n = DIRECT_BUFFER - writer->fill < bytes ? DIRECT_BUFFER - writer->fill : bytes;
+        memcpy(writer->buffer + writer->fill, from, n);
+        writer->fill += n;
+        from += n;
+        bytes -= n;
+        if (writer->fill == DIRECT_BUFFER)
+        {
+            flushDirect(writer, DIRECT_BUFFER);
+            writer->fill = 0;
+        }
+    }
+}
+
+
+// Write remaining bytes and close output: whole blocks directly, the unaligned
+// tail without O_DIRECT, so the file ends exactly after the last byte
+// Returns 0 on success or errno of the first failed write
+int finishDirect(Track *output)
+{
+    DirectWriter *writer = output->direct;
+    long aligned = writer->direct ? writer->fill / DIRECT_ALIGN * DIRECT_ALIGN : 0;
+    if (aligned > 0)
+    {
+        flushDirect(writer, aligned);
+        memmove(writer->buffer, writer->buffer + aligned, writer->fill - aligned);
+        writer->fill -= aligned;
+    }
+    if (writer->fill > 0)
+    {
+        if (writer->direct)
+        {
+            fcntl(writer->fd, F_SETFL, fcntl(writer->fd, F_GETFL) & ~O_DIRECT);
+        }
+        flushDirect(writer, writer->fill);
+    }
+    if (close(writer->fd) != 0 && writer->error == 0)
+    {
+        writer->error = errno;
+    }
+    int error = writer->error;
+    free(writer->buffer);
+    free(writer);
+    output->direct = NULL;
+    return error;
+}
+
+
+
+// ----------------------------------------------------------
+// P R E V I E W
+// Tracks are read as mono and decimated, only every factor-th
+// sample of the low pass is computed, rendering runs at the
+// preview rate
+// ----------------------------------------------------------
+
+
+// Set up preview readers of all tracks, scale layout to the preview rate and switch output format
+// to mono, decimated, 8 or 16 bit. Tempo-matched crossfades are decimated the same way
+// Returns 0 on success
+int startPreview(Track *playlist, Track *output, int factor, int bits)
+{
+    Preview *preview = calloc(1, sizeof(Preview));
+    if (preview == NULL)
+    {
+        return 2;
+    }
+    output->preview = preview;
+    preview->factor = factor;
+    preview->taps = 12 * factor + 1;
+    preview->coefs = malloc(preview->taps * sizeof(float));
+    if (preview->coefs == NULL)
+    {
+        return 2;
+    }
+
+    // Windowed sinc (Blackman), cut off at 90% of the new Nyquist frequency, unity gain
+    double cutoff = 0.45 / factor;
+    double sum = 0;
+    int center = preview->taps / 2;
+    for (int k = 0; k < preview->taps; k++)
+    {
+        double t = k - center;
+        double sinc = t == 0 ? 2 * cutoff : sin(2 * M_PI * cutoff * t) / (M_PI * t);
+        double window = 0.42 - 0.5 * cos(2 * M_PI * k / (preview->taps - 1)) + 0.08 * cos(4 * M_PI * k / (preview->taps - 1));
+        preview->coefs[k] = sinc * window;
+        sum += preview->coefs[k];
+    }
+    for (int k = 0; k < preview->taps; k++)
+    {
+        preview->coefs[k] /= sum;
+    }
+
+    // Same layout at the preview rate, each track gets a reader
+    long part = samplesPart / factor;
+    long fade = samplesFade / factor;
+    long consumed = 0;
+    for (Track *track = playlist; track != NULL; track = track->next)
+    {
+        Preview *reader = malloc(sizeof(Preview));
+        if (reader == NULL)
+        {
+            return 2;
+        }
+        *reader = *preview;
+        track->preview = reader;
+        reader->at = -1;
+        reader->count = 0;
+        reader->mono = malloc(((PREVIEW_BLOCK - 1) * factor + reader->taps) * sizeof(float));
+        reader->block = malloc(PREVIEW_BLOCK * sizeof(int16_t));
+        if (reader->mono == NULL || reader->block == NULL)
+        {
+            return 2;
+        }
+
+        // Preview sample k of the medley is read where sample k * factor of the full render is read:
+        // the scaled layout drifts a little per track, position in the part continues after the crossfade
+        long drift = (track->trackNumber - 1) * ((part - fade) * factor - (samplesPart - samplesFade));
+        long lead = track->prev != NULL && fade > 0 ? factor : 0;
+        reader->phase = drift + lead + (track->prev != NULL && samplesFade > 0 ? consumed - samplesFade : 0);
+        consumed = track->stretch != NULL ? track->stretch->consumed : samplesFade - 1;
+
+        // Tempo-matched crossfade: downmix and decimate the rendered frames, edges are held
+        Stretch *stretch = track->stretch;
+        if (stretch != NULL && fade < 2)
+        {
+            freeStretch(track);
+        }
+        else if (stretch != NULL)
+        {
+            int channels = track->fmt.nChannels;
+            int16_t *frames = malloc((fade - 1) * sizeof(int16_t));
+            if (frames == NULL)
+            {
+                return 2;
+            }
+            for (long n = 0; n < fade - 1; n++)
+            {
+                long at = (part - fade + 1 + n) * factor + drift - (samplesPart - samplesFade + 1) - center;
+                float sample = 0;
+                for (int k = 0; k < preview->taps; k++)
+                {
+                    long m = at + k < 0 ? 0 : at + k > samplesFade - 2 ? samplesFade - 2 : at + k;
+                    float mono = 0;
+                    for (int c = 0; c < channels; c++)
+                    {
+                        mono += stretch->frames[m * channels + c];
+                    }
+                    sample += preview->coefs[k] * mono / channels;
+                }
+                frames[n] = clip16(sample);
+            }
+            free(stretch->frames);
+            stretch->frames = frames;
+            stretch->consumed = fade - 1;
+        }
+    }
+    samplesPart = part;
+    samplesFade = fade;
+
+    output->fmt.nChannels = 1;
+    output->fmt.nSamplesPerSec /= factor;
+    output->fmt.wBitsPerSample = bits;
+    output->fmt.nBlockAlign = bits / 8;
+    output->fmt.nAvgBytesPerSec = output->fmt.nSamplesPerSec * output->fmt.nBlockAlign;
+    output->data.ckSize = ((trackCount * samplesPart) - (trackCount - 1) * samplesFade) * output->fmt.nBlockAlign;
+    return 0;
+}
+
+
+// Read frame of the part of a track at its current sample, from file or from the preview block
+void readPart(Track *track, int16_t *frame)
+{
+    Preview *preview = track->preview;
+    if (preview == NULL)
+    {
+        readFrames(track, frame, 1);
+        return;
+    }
+    if (track->sampleCount < preview->first || track->sampleCount >= preview->first + preview->count)
+    {
+        fillPreview(track);
+    }
+    frame[0] = preview->block[track->sampleCount - preview->first];
+}
+
+
+// Compute preview samples of a track from its current sample on: low pass of the mono source
+// around every factor-th sample, the overlap with the block before is kept when reading on
+void fillPreview(Track *track)
+{
+    Preview *preview = track->preview;
+    long span = (PREVIEW_BLOCK - 1) * preview->factor + preview->taps;
+    long step = PREVIEW_BLOCK * preview->factor;
+    long start = track->markerIn + preview->phase + track->sampleCount * preview->factor - preview->taps / 2;
+
+    if (preview->count > 0 && track->sampleCount == preview->first + preview->count)
+    {
+        memmove(preview->mono, preview->mono + step, (span - step) * sizeof(float));
+        readMono(track, start + span - step, step, preview->mono + span - step);
+    }
+    else
+    {
+        readMono(track, start, span, preview->mono);
+    }
+    preview->first = track->sampleCount;
+    preview->count = PREVIEW_BLOCK;
+
+    for (long s = 0; s < PREVIEW_BLOCK; s++)
+    {
+        // Dot product in four lanes, friendly to SIMD
+        float *window = preview->mono + s * preview->factor;
+        float lane[4] = {0};
+        int k = 0;
+        for (; k + 4 <= preview->taps; k += 4)
+        {
+            lane[0] += window[k] * preview->coefs[k];
+            lane[1] += window[k + 1] * preview->coefs[k + 1];
+            lane[2] += window[k + 2] * preview->coefs[k + 2];
+            lane[3] += window[k + 3] * preview->coefs[k + 3];
+        }
+        for (; k < preview->taps; k++)
+        {
+            lane[0] += window[k] * preview->coefs[k];
+        }
+        preview->block[s] = clip16(lane[0] + lane[1] + lane[2] + lane[3]);
+    }
+}
+
+
+// Read count mono samples (mean of all channels) from sample start on, silent outside the track
+// Seeks only if the file pointer isn't there already
+void readMono(Track *track, long start, long count, float *mono)
+{
+    Preview *preview = track->preview;
+    int channels = track->fmt.nChannels;
+    long frames = track->data.ckSize / track->fmt.nBlockAlign;
+    int16_t buffer[4096 * channels];
+
+    memset(mono, 0, count * sizeof(float));
+    long done = start < 0 ? -start : 0;
+    long end = frames - start < count ? frames - start : count;
+    if (done >= end)
+    {
+        return;
+    }
+    if (start + done != preview->at)
+    {
+        seekSample(track, start + done);
+    }
+    while (done < end)
+    {
+        long n = end - done < 4096 ? end - done : 4096;
+        long read = readFrames(track, buffer, n);
+        for (long f = 0; f < read; f++)
+        {
+            float sum = 0;
+            for (int c = 0; c < channels; c++)
+            {
+                sum += buffer[f * channels + c];
+            }
+            mono[done + f] = sum / channels;
+        }
+        if (read < n)
+        {
+            preview->at = -1;
+            return;
+        }
+        done += n;
+    }
+    preview->at = start + done;
+}
+
+
+// Write rendered preview frames, 8 bit wave is unsigned
+void previewFrames(Track *output, int16_t *frames, long count)
+{
+    if (output->fmt.wBitsPerSample != 8)
+    {
+        emitFrames(output, frames, count);
+        return;
+    }
+    BYTE bytes[256];
+    for (long done = 0; done < count; done += 256)
+    {
+        long n = count - done < 256 ? count - done : 256;
+        for (long f = 0; f < n; f++)
+        {
+            bytes[f] = (frames[done + f] >> 8) + 128;
+        }
+        emitFrames(output, bytes, n);
+    }
+}
+
+
+// Pad odd 8 bit data, free filter of output
+void finishPreview(Track *output)
+{
+    Preview *preview = output->preview;
+    if (output->data.ckSize % 2 && output->encoder == NULL)
+    {
+        BYTE pad = 0;
+        writeBytes(output, &pad, 1);
+    }
+    free(preview->coefs);
+    free(preview);
+    output->preview = NULL;
+}
+
+
+// Free preview reader of a track, if there is one
+void freePreview(Track *track)
+{
+    if (track->preview == NULL)
+    {
+        return;
+    }
+    free(track->preview->mono);
+    free(track->preview->block);
+    free(track->preview);
+    track->preview = NULL;
+}
+
+
+
+// ----------------------------------------------------------
+// F L A C   E N C O D E R
+// Blocks of 4096 frames are LPC analysed and encoded by a
+// pool of worker threads and written in order
+// ----------------------------------------------------------
+
+
+// Write FLAC metadata (STREAMINFO, SEEKTABLE) as placeholders and start worker threads
+// Returns 0 on success
+int startEncoder(Track *output)
+{
+    FlacEncoder *encoder = calloc(1, sizeof(FlacEncoder));
+    if (encoder == NULL)
+    {
+        return 2;
+    }
+    pthread_mutex_init(&encoder->lock, NULL);
+    pthread_cond_init(&encoder->work, NULL);
+    pthread_cond_init(&encoder->finished, NULL);
+    encoder->file = output->audiofile;
+    encoder->blockSize = 4096;
+    encoder->channels = output->fmt.nChannels;
+    encoder->rate = output->fmt.nSamplesPerSec;
+    encoder->totalSamples = output->data.ckSize / output->fmt.nBlockAlign;
+    encoder->minFrame = LONG_MAX;
+
+    // One seek point about every 10 seconds, always on a block boundary
+    encoder->seekSpacing = (10 * encoder->rate / encoder->blockSize + 1) * encoder->blockSize;
+    encoder->seekCount = (encoder->totalSamples + encoder->seekSpacing - 1) / encoder->seekSpacing;
+    encoder->points = calloc(encoder->seekCount + 1, sizeof(SeekPoint));
+    encoder->pointFrames = calloc(encoder->seekCount + 1, sizeof(long));
+
+    for (int b = 0; b < 2; b++)
+    {
+        encoder->batch[b].pcm = malloc(64 * encoder->blockSize * encoder->channels * sizeof(int16_t));
+        for (int f = 0; f < 64; f++)
+        {
+            // Worst case: verbatim side channel plus headers
+            encoder->batch[b].out[f].bytes = malloc(encoder->blockSize * encoder->channels * 3 + 64);
+            if (encoder->batch[b].out[f].bytes == NULL)
+            {
+                encoder->error = 1;
+            }
+        }
+        if (encoder->batch[b].pcm == NULL)
+        {
+            encoder->error = 1;
+        }
+    }
+    if (encoder->points == NULL || encoder->pointFrames == NULL || encoder->error)
+    {
+        freeEncoder(encoder);
+        return 2;
+    }
+    for (long p = 0; p < encoder->seekCount; p++)
+    {
+        encoder->points[p].sample = UINT64_MAX;
+    }
+
+    // Metadata placeholders, rewritten once all frames are known
+    BYTE header[4 + 4 + 34 + 4] = {'f', 'L', 'a', 'C', 0x00, 0, 0, 34};
+    long seekBytes = encoder->seekCount * 18;
+    header[42] = 0x83;
+    header[43] = seekBytes >> 16;
+    header[44] = seekBytes >> 8;
+    header[45] = seekBytes;
+    fwrite(header, sizeof(header), 1, encoder->file);
+    BYTE point[18] = {0};
+    for (long p = 0; p < encoder->seekCount; p++)
+    {
+        fwrite(point, sizeof(point), 1, encoder->file);
+    }
+
+    // Worker pool, one thread per CPU core (no threads: blocks are encoded while writing)
+    output->encoder = encoder;
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    encoder->threads = malloc((workers > 0 ? workers : 1) * sizeof(pthread_t));
+    while (encoder->threads != NULL && encoder->workers < workers &&
+           pthread_create(&encoder->threads[encoder->workers], NULL, encodeWorker, encoder) == 0)
+    {
+        encoder->workers++;
+    }
+    return 0;
+}
+
+
+// Wait for batch handed to workers and write its frames in order
+void writeBatch(FlacEncoder *encoder)
+{
+    pthread_mutex_lock(&encoder->lock);
+    EncodeBatch *batch = encoder->active;
+    while (batch != NULL && batch->done < batch->count)
+    {
+        // Nobody to wait for: encode in this thread
+        if (encoder->workers == 0)
+        {
+            long b = batch->next++;
+            pthread_mutex_unlock(&encoder->lock);
+            encodeBlock(batch, b, encoder);
+            pthread_mutex_lock(&encoder->lock);
+            batch->done++;
+            continue;
+        }
+        pthread_cond_wait(&encoder->finished, &encoder->lock);
+    }
+    encoder->active = NULL;
+    pthread_mutex_unlock(&encoder->lock);
+
+    for (long b = 0; batch != NULL && b < batch->count; b++)
+    {
+        // Seek point for frames starting on the spacing
+        long sample = (batch->firstFrame + b) * encoder->blockSize;
+        if (sample % encoder->seekSpacing == 0 && sample / encoder->seekSpacing < encoder->seekCount)
+        {
+            encoder->points[sample / encoder->seekSpacing].sample = sample;
+            encoder->points[sample / encoder->seekSpacing].offset = encoder->bytes;
+            encoder->pointFrames[sample / encoder->seekSpacing] = batch->frames[b];
+        }
+
+        long length = batch->out[b].length;
+        fwrite(batch->out[b].bytes, length, 1, encoder->file);
+        encoder->bytes += length;
+        encoder->minFrame = length < encoder->minFrame ? length : encoder->minFrame;
+        encoder->maxFrame = length > encoder->maxFrame ? length : encoder->maxFrame;
+    }
+}
+
+
+// Hand batch being filled to workers, after writing the one they are working on
+void submitBatch(FlacEncoder *encoder)
+{
+    writeBatch(encoder);
+
+    EncodeBatch *batch = &encoder->batch[encoder->filling];
+    pthread_mutex_lock(&encoder->lock);
+    batch->next = 0;
+    batch->done = 0;
+    encoder->active = batch;
+    pthread_cond_broadcast(&encoder->work);
+    pthread_mutex_unlock(&encoder->lock);
+
+    // Fill the other batch meanwhile
+    encoder->filling = !encoder->filling;
+    EncodeBatch *next = &encoder->batch[encoder->filling];
+    next->count = 0;
+    next->firstFrame = batch->firstFrame + batch->count;
+}
+
+
+// Encode last (partial) block, stop workers and complete STREAMINFO and SEEKTABLE
+// Returns 0 on success, 2 if a block could not be encoded (out of memory)
+int finishEncoder(Track *output)
+{
+    FlacEncoder *encoder = output->encoder;
+    EncodeBatch *batch = &encoder->batch[encoder->filling];
+    if (encoder->samples % encoder->blockSize)
+    {
+        batch->frames[batch->count++] = encoder->samples % encoder->blockSize;
+    }
+    if (batch->count > 0)
+    {
+        submitBatch(encoder);
+    }
+    writeBatch(encoder);
+
+    // STREAMINFO: block sizes, frame sizes, sample rate, channels, bit depth, total samples (MD5 left unset)
+    long block = encoder->samples < encoder->blockSize ? encoder->samples : encoder->blockSize;
+    uint64_t packed = ((uint64_t) encoder->rate << 44) | ((uint64_t)(encoder->channels - 1) << 41) | ((uint64_t) 15 << 36) | encoder->samples;
+    BYTE info[34] = {0};
+    long values[] = {block, block, encoder->minFrame == LONG_MAX ? 0 : encoder->minFrame, encoder->maxFrame};
+    int widths[] = {2, 2, 3, 3};
+    for (int v = 0, at = 0; v < 4; at += widths[v], v++)
+    {
+        for (int b = 0; b < widths[v]; b++)
+        {
+            info[at + b] = values[v] >> (8 * (widths[v] - 1 - b));
+        }
+    }
+    for (int b = 0; b < 8; b++)
+    {
+        info[10 + b] = packed >> (56 - 8 * b);
+    }
+    fseek(encoder->file, 8, SEEK_SET);
+    fwrite(info, sizeof(info), 1, encoder->file);
+
+    // SEEKTABLE: sample, byte offset from first frame, samples in frame
+    fseek(encoder->file, 8 + 34 + 4, SEEK_SET);
+    for (long p = 0; p < encoder->seekCount; p++)
+    {
+        BYTE point[18];
+        for (int b = 0; b < 8; b++)
+        {
+            point[b] = encoder->points[p].sample >> (56 - 8 * b);
+            point[8 + b] = encoder->points[p].offset >> (56 - 8 * b);
+        }
+        point[16] = encoder->pointFrames[p] >> 8;
+        point[17] = encoder->pointFrames[p];
+        fwrite(point, sizeof(point), 1, encoder->file);
+    }
+    fseek(encoder->file, 0, SEEK_END);
+
+    int error = encoder->error ? 2 : 0;
+    freeEncoder(encoder);
+    output->encoder = NULL;
+    return error;
+}
+
+
+// Stop worker threads and free encoder, also a partly set up one
+void freeEncoder(FlacEncoder *encoder)
+{
+    pthread_mutex_lock(&encoder->lock);
+    encoder->quit = 1;
+    pthread_cond_broadcast(&encoder->work);
+    pthread_mutex_unlock(&encoder->lock);
+    for (long t = 0; t < encoder->workers; t++)
+    {
+        pthread_join(encoder->threads[t], NULL);
+    }
+
+    for (int b = 0; b < 2; b++)
+    {
+        free(encoder->batch[b].pcm);
+        for (int f = 0; f < 64; f++)
+        {
+            free(encoder->batch[b].out[f].bytes);
+        }
+    }
+    pthread_mutex_destroy(&encoder->lock);
+    pthread_cond_destroy(&encoder->work);
+    pthread_cond_destroy(&encoder->finished);
+    free(encoder->threads);
+    free(encoder->points);
+    free(encoder->pointFrames);
+    free(encoder);
+}
+
+
+// Worker thread: encode blocks of the active batch
+void *encodeWorker(void *arg)
+{
+    FlacEncoder *encoder = arg;
+    pthread_mutex_lock(&encoder->lock);
+    while (1)
+    {
+        EncodeBatch *batch = encoder->active;
+        if (batch != NULL && batch->next < batch->count)
+        {
+            long b = batch->next++;
+            pthread_mutex_unlock(&encoder->lock);
+            encodeBlock(batch, b, encoder);
+            pthread_mutex_lock(&encoder->lock);
+            if (++batch->done == batch->count)
+            {
+                pthread_cond_signal(&encoder->finished);
+            }
+            continue;
+        }
+        if (encoder->quit)
+        {
+            pthread_mutex_unlock(&encoder->lock);
+            return NULL;
+        }
+        pthread_cond_wait(&encoder->work, &encoder->lock);
+    }
+}
+
+
+// Append n bits (up to 32) of value
+void putBits(BitWriter *writer, uint32_t value, int n)
+{
+    writer->cache = (writer->cache << n) | (value & (((uint64_t) 1 << n) - 1));
+    writer->count += n;
+    while (writer->count >= 8)
+    {
+        writer->count -= 8;
+        writer->bytes[writer->length++] = writer->cache >> writer->count;
+    }
+}
+
+
+// Append signed value as n bit two's complement
+void putSigned(BitWriter *writer, int32_t value, int n)
+{
+    putBits(writer, (uint32_t) value, n);
+}
+
+
+// CRC-8 of frame header, polynomial x^8 + x^2 + x + 1
+BYTE crc8(BYTE *bytes, long length)
+{
+    BYTE crc = 0;
+    for (long b = 0; b < length; b++)
+    {
+        crc ^= bytes[b];
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+
+// CRC-16 of every byte value, table for crc16
+WORD crc16Table[256];
+pthread_once_t crc16Once = PTHREAD_ONCE_INIT;
+
+
+// Fill CRC-16 table, polynomial x^16 + x^15 + x^2 + 1
+void makeCrc16Table()
+{
+    for (int value = 0; value < 256; value++)
+    {
+        WORD crc = value << 8;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x8005 : crc << 1;
+        }
+        crc16Table[value] = crc;
+    }
+}
+
+
+// CRC-16 of frame (encoder and decoder), one table lookup per byte
+WORD crc16(BYTE *bytes, long length)
+{
+    pthread_once(&crc16Once, makeCrc16Table);
+    WORD crc = 0;
+    for (long b = 0; b < length; b++)
+    {
+        crc = (crc << 8) ^ crc16Table[(crc >> 8) ^ bytes[b]];
+    }
+    return crc;
+}
+
+
+// Estimate bits of Rice coded residual, choosing partition order (0 to 8) and Rice parameter per partition
+long riceBits(int32_t *residual, long blockSize, int order, int *partitionOrder, int *params)
+{
+    // Sum of folded residuals per partition at finest order, merged for coarser orders
+    uint64_t sums[256] = {0};
+    int finest = 8;
+    while (finest > 0 && (blockSize % (1 << finest) || (blockSize >> finest) <= order))
+    {
+        finest--;
+    }
+    for (long i = order; i < blockSize; i++)
+    {
+        uint32_t u = ((uint32_t) residual[i] << 1) ^ (residual[i] >> 31);
+        sums[i / (blockSize >> finest)] += u;
+    }
+
+    long best = LONG_MAX;
+    for (int p = finest; p >= 0; p--)
+    {
+        int parts = 1 << p;
+        long bits = 6;
+        int k[256];
+        for (int part = 0; part < parts; part++)
+        {
+            long count = (blockSize >> p) - (part == 0 ? order : 0);
+            uint64_t mean = count > 0 ? sums[part] / count : 0;
+            k[part] = 0;
+            while (k[part] < 30 && ((uint64_t) 1 << (k[part] + 1)) <= mean + 1)
+            {
+                k[part]++;
+            }
+            bits += 5 + count * (k[part] + 1) + (sums[part] >> k[part]);
+        }
+        if (bits < best)
+        {
+            best = bits;
+            *partitionOrder = p;
+            memcpy(params, k, parts * sizeof(int));
+        }
+
+        // Merge pairs of partitions for next coarser order
+        for (int part = 0; part < parts / 2; part++)
+        {
+            sums[part] = sums[2 * part] + sums[2 * part + 1];
+        }
+    }
+    return best;
+}
+
+
+// Write Rice coded residual with given partition order and parameters
+void putResidual(BitWriter *writer, int32_t *residual, long blockSize, int order, int partitionOrder, int *params)
+{
+    int parts = 1 << partitionOrder;
+    int method = 0;
+    for (int part = 0; part < parts; part++)
+    {
+        method |= params[part] > 14;
+    }
+    putBits(writer, method, 2);
+    putBits(writer, partitionOrder, 4);
+
+    long i = order;
+    for (int part = 0; part < parts; part++)
+    {
+        int k = params[part];
+        putBits(writer, k, method ? 5 : 4);
+        long end = (part + 1) * (blockSize >> partitionOrder);
+        for (; i < end; i++)
+        {
+            uint32_t u = ((uint32_t) residual[i] << 1) ^ (residual[i] >> 31);
+            uint32_t q = u >> k;
+            while (q >= 32)
+            {
+                putBits(writer, 0, 32);
+                q -= 32;
+            }
+            putBits(writer, 1, q + 1);
+            putBits(writer, u, k);
+        }
+    }
+}
+
+
+// Encode one channel of a block: constant, fixed predictor, LPC or verbatim, whatever is smallest
+void encodeSubframe(BitWriter *writer, int32_t *x, long n, int bps, int32_t *residual)
+{
+    // CONSTANT
+    long same = 1;
+    while (same < n && x[same] == x[0])
+    {
+        same++;
+    }
+    if (same == n)
+    {
+        putBits(writer, 0, 8);
+        putSigned(writer, x[0], bps);
+        return;
+    }
+
+    int partitionOrder;
+    int params[256];
+    long bestBits = 8 + n * bps;
+    int bestType = 1;
+    int bestOrder = 0;
+
+    // FIXED predictors, order 0 to 4
+    for (int order = 0; order <= 4 && order < n; order++)
+    {
+        for (long i = order; i < n; i++)
+        {
+            switch (order)
+            {
+                case 0:
+                    residual[i] = x[i];
+                    break;
+                case 1:
+                    residual[i] = x[i] - x[i - 1];
+                    break;
+                case 2:
+                    residual[i] = x[i] - 2 * x[i - 1] + x[i - 2];
+                    break;
+                case 3:
+                    residual[i] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+                    break;
+                case 4:
+                    residual[i] = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4];
+                    break;
+            }
+        }
+        long bits = 8 + order * bps + riceBits(residual, n, order, &partitionOrder, params);
+        if (bits < bestBits)
+        {
+            bestBits = bits;
+            bestType = 8;
+            bestOrder = order;
+        }
+    }
+
+    // LPC: Welch windowed autocorrelation, Levinson-Durbin recursion, coefficients quantized to 12 bit
+    int maxOrder = n > 64 ? 8 : 0;
+    int32_t qcoefs[8];
+    int shift = 0;
+    int lpcOrder = 0;
+    if (maxOrder > 0)
+    {
+        double autoc[9] = {0};
+        double *windowed = malloc(n * sizeof(double));
+        if (windowed != NULL)
+        {
+            double half = (n - 1) / 2.0;
+            for (long i = 0; i < n; i++)
+            {
+                double w = (i - half) / (half + 1);
+                windowed[i] = x[i] * (1 - w * w);
+            }
+            for (int lag = 0; lag <= maxOrder; lag++)
+            {
+                double sum = 0;
+                for (long i = lag; i < n; i++)
+                {
+                    sum += windowed[i] * windowed[i - lag];
+                }
+                autoc[lag] = sum;
+            }
+            free(windowed);
+        }
+
+        // Levinson-Durbin, keep the order with the lowest estimated size
+        double lpc[8] = {0};
+        double err = autoc[0];
+        double bestEstimate = 1e300;
+        double chosen[8];
+        for (int order = 0; order < maxOrder && err > 0; order++)
+        {
+            double r = -autoc[order + 1];
+            for (int j = 0; j < order; j++)
+            {
+                r += lpc[j] * autoc[order - j];
+            }
+            r /= err;
+            double tmp[8];
+            memcpy(tmp, lpc, sizeof(lpc));
+            lpc[order] = -r;
+            for (int j = 0; j < order; j++)
+            {
+                lpc[j] = tmp[j] + r * tmp[order - 1 - j];
+            }
+            err *= 1 - r * r;
+
+            double perSample = err > 0 ? 0.5 * log2(err / n) : 0;
+            double estimate = n * (perSample > 0 ? perSample : 0) + (order + 1) * (12 + bps);
+            if (estimate < bestEstimate)
+            {
+                bestEstimate = estimate;
+                lpcOrder = order + 1;
+                memcpy(chosen, lpc, sizeof(lpc));
+            }
+        }
+
+        // Quantize with 12 bit precision, carrying the rounding error
+        if (lpcOrder > 0)
+        {
+            double cmax = 0;
+            for (int j = 0; j < lpcOrder; j++)
+            {
+                cmax = fmax(cmax, fabs(chosen[j]));
+            }
+            int exponent;
+            frexp(cmax, &exponent);
+            shift = 12 - 1 - exponent;
+            shift = shift > 15 ? 15 : shift < 0 ? 0 : shift;
+            double carry = 0;
+            for (int j = 0; j < lpcOrder; j++)
+            {
+                carry += chosen[j] * (1 << shift);
+                long q = lround(carry);
+                q = q > 2047 ? 2047 : q < -2048 ? -2048 : q;
+                qcoefs[j] = q;
+                carry -= q;
+            }
+            for (long i = lpcOrder; i < n; i++)
+            {
+                int64_t sum = 0;
+                for (int j = 0; j < lpcOrder; j++)
+                {
+                    sum += (int64_t) qcoefs[j] * x[i - 1 - j];
+                }
+                residual[i] = x[i] - (int32_t)(sum >> shift);
+            }
+            long bits = 8 + lpcOrder * bps + 4 + 5 + lpcOrder * 12 + riceBits(residual, n, lpcOrder, &partitionOrder, params);
+            if (bits < bestBits)
+            {
+                bestBits = bits;
+                bestType = 32;
+                bestOrder = lpcOrder;
+            }
+        }
+    }
+
+    // VERBATIM
+    if (bestType == 1)
+    {
+        putBits(writer, 1 << 1, 8);
+        for (long i = 0; i < n; i++)
+        {
+            putSigned(writer, x[i], bps);
+        }
+        return;
+    }
+
+    // Recompute residual of the winner and write it
+    if (bestType == 8)
+    {
+        for (long i = bestOrder; i < n; i++)
+        {
+            switch (bestOrder)
+            {
+                case 0:
+                    residual[i] = x[i];
+                    break;
+                case 1:
+                    residual[i] = x[i] - x[i - 1];
+                    break;
+                case 2:
+                    residual[i] = x[i] - 2 * x[i - 1] + x[i - 2];
+                    break;
+                case 3:
+                    residual[i] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+                    break;
+                case 4:
+                    residual[i] = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4];
+                    break;
+            }
+        }
+        putBits(writer, (8 + bestOrder) << 1, 8);
+    }
+    else
+    {
+        putBits(writer, (32 + bestOrder - 1) << 1, 8);
+    }
+    riceBits(residual, n, bestOrder, &partitionOrder, params);
+
+    for (int i = 0; i < bestOrder; i++)
+    {
+        putSigned(writer, x[i], bps);
+    }
+    if (bestType == 32)
+    {
+        putBits(writer, 12 - 1, 4);
+        putSigned(writer, shift, 5);
+        for (int j = 0; j < bestOrder; j++)
+        {
+            putSigned(writer, qcoefs[j], 12);
+        }
+    }
+    putResidual(writer, residual, n, bestOrder, partitionOrder, params);
+}
+
+
+// Encode block b of batch into one FLAC frame
+void encodeBlock(EncodeBatch *batch, long b, FlacEncoder *encoder)
+{
+    int channels = encoder->channels;
+    long n = batch->frames[b];
+    int16_t *pcm = batch->pcm + b * encoder->blockSize * channels;
+    BitWriter *writer = &batch->out[b];
+    writer->length = 0;
+    writer->count = 0;
+
+    // Out of memory: the frame is missing, let finishEncoder fail the run
+    int32_t *work = malloc(5 * n * sizeof(int32_t));
+    if (work == NULL)
+    {
+        pthread_mutex_lock(&encoder->lock);
+        encoder->error = 1;
+        pthread_mutex_unlock(&encoder->lock);
+        return;
+    }
+    int32_t *left = work;
+    int32_t *right = work + n;
+    int32_t *mid = work + 2 * n;
+    int32_t *side = work + 3 * n;
+    int32_t *residual = work + 4 * n;
+
+    for (long i = 0; i < n; i++)
+    {
+        left[i] = pcm[i * channels];
+        right[i] = pcm[i * channels + channels - 1];
+        mid[i] = (left[i] + right[i]) >> 1;
+        side[i] = left[i] - right[i];
+    }
+
+    // Stereo decorrelation: pick the pair with the smallest second order residual
+    int mode = channels - 1;
+    if (channels == 2)
+    {
+        uint64_t cost[4] = {0};
+        int32_t *signals[4] = {left, right, mid, side};
+        for (int c = 0; c < 4; c++)
+        {
+            for (long i = 2; i < n; i++)
+            {
+                int32_t r = signals[c][i] - 2 * signals[c][i - 1] + signals[c][i - 2];
+                cost[c] += r < 0 ? -r : r;
+            }
+        }
+        uint64_t modes[4] = {cost[0] + cost[1], cost[0] + cost[3], cost[3] + cost[1], cost[2] + cost[3]};
+        int assignment[4] = {1, 8, 9, 10};
+        int best = 0;
+        for (int m = 1; m < 4; m++)
+        {
+            best = modes[m] < modes[best] ? m : best;
+        }
+        mode = assignment[best];
+    }
+
+    // Frame header: sync, fixed block size, block size code, sample rate from STREAMINFO, channels, 16 bit
+    long frame = batch->firstFrame + b;
+    putBits(writer, 0xFFF8, 16);
+    putBits(writer, n == 4096 ? 12 : 7, 4);
+    putBits(writer, 0, 4);
+    putBits(writer, mode, 4);
+    putBits(writer, 4, 3);
+    putBits(writer, 0, 1);
+
+    // Frame number, UTF-8 like coding
+    int extra = frame < 0x80 ? 0 : frame < 0x800 ? 1 : frame < 0x10000 ? 2 : frame < 0x200000 ? 3 : frame < 0x4000000 ? 4 : 5;
+    putBits(writer, extra ? ((0xFF00 >> (extra + 1)) & 0xFF) | (frame >> (6 * extra)) : frame, 8);
+    for (int e = extra - 1; e >= 0; e--)
+    {
+        putBits(writer, 0x80 | ((frame >> (6 * e)) & 0x3F), 8);
+    }
+    if (n != 4096)
+    {
+        putBits(writer, n - 1, 16);
+    }
+    putBits(writer, crc8(writer->bytes, writer->length), 8);
+
+    // Subframes
+    int32_t *first = mode == 9 ? side : mode == 10 ? mid : left;
+    int32_t *second = mode == 8 || mode == 10 ? side : right;
+    encodeSubframe(writer, first, n, 16 + (mode == 9), residual);
+    if (channels == 2)
+    {
+        encodeSubframe(writer, second, n, 16 + (mode == 8 || mode == 10), residual);
+    }
+
+    // Footer: byte align, CRC-16
+    if (writer->count)
+    {
+        putBits(writer, 0, 8 - writer->count);
+    }
+    putBits(writer, crc16(writer->bytes, writer->length), 16);
+    free(work);
 }
 
 